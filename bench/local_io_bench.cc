@@ -0,0 +1,125 @@
+/**
+  local I/O cost of a transfer, without the network
+
+  upload: the 4 KB std::ifstream loop the transfers used before vs the mmap source,
+  download: the 4 KB std::ofstream loop vs preallocate + pwrite of large aligned chunks.
+  every chunk is copied once between the packet and the caller buffer, as libssh does, so both sides pay that equally.
+
+  usage: local_io_bench [MiB=512] [dir=.]
+  prints CPU seconds (user + sys) per GiB for each path
+*/
+#include "../src/sftp_pip_local_io.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+
+#define OLD_CHUNK 4096
+#define NEW_CHUNK (256 * 1024)
+
+static double cpu_seconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static double wall_seconds() { return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
+
+// stands in for the copy into the ssh packet, keeps the compiler from dropping the reads
+static std::vector<char> packet(NEW_CHUNK);
+static volatile unsigned long long sink_sum = 0;
+static void consume(const char* data, size_t len)
+{
+    std::memcpy(packet.data(), data, len);
+    sink_sum += (unsigned char)packet[len / 2];
+}
+
+static void report(const char* name, double cpu, double wall, uint64_t bytes)
+{
+    double gib = bytes / (1024.0 * 1024.0 * 1024.0);
+    std::printf("%-22s cpu_s_per_gib %.3f  wall_s_per_gib %.3f\n", name, cpu / gib, wall / gib);
+}
+
+int main(int argc, char** argv)
+{
+    uint64_t mib = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 512;
+    std::string dir = argc > 2 ? argv[2] : ".";
+    uint64_t bytes = mib * 1024 * 1024;
+    std::string src = dir + "/local_io_bench.src";
+    std::string dst = dir + "/local_io_bench.dst";
+
+    {
+        std::vector<char> block(NEW_CHUNK);
+        for (size_t i = 0; i < block.size(); ++i) block[i] = (char)(i * 131 + 7);
+        std::ofstream out(src, std::ios::binary | std::ios::trunc);
+        for (uint64_t done = 0; done < bytes; done += block.size()) out.write(block.data(), block.size());
+    }
+
+    // warm the page cache so both upload paths read from memory
+    {
+        LocalSource warm;
+        warm.open(src);
+        std::vector<char> buffer(NEW_CHUNK);
+        for (uint64_t off = 0; off < warm.size(); off += NEW_CHUNK) warm.view(off, NEW_CHUNK, buffer.data());
+    }
+
+    double cpu = cpu_seconds(), wall = wall_seconds();
+    {
+        std::ifstream file(src, std::ios::binary);
+        char buffer[OLD_CHUNK];
+        while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0) consume(buffer, file.gcount());
+    }
+    report("upload ifstream 4K", cpu_seconds() - cpu, wall_seconds() - wall, bytes);
+
+    cpu = cpu_seconds(), wall = wall_seconds();
+    {
+        LocalSource file;
+        file.open(src);
+        std::vector<char> buffer(NEW_CHUNK);
+        for (uint64_t off = 0; off < file.size(); off += NEW_CHUNK) {
+            auto n = (size_t)std::min<uint64_t>(NEW_CHUNK, file.size() - off);
+            consume(file.view(off, n, buffer.data()), n);
+        }
+    }
+    report("upload mmap 256K", cpu_seconds() - cpu, wall_seconds() - wall, bytes);
+
+    std::vector<char> payload(NEW_CHUNK);
+    for (size_t i = 0; i < payload.size(); ++i) payload[i] = (char)(i * 31 + 3);
+
+    cpu = cpu_seconds(), wall = wall_seconds();
+    {
+        std::ofstream out(dst, std::ios::binary | std::ios::trunc);
+        char buffer[OLD_CHUNK];
+        for (uint64_t done = 0; done < bytes; done += OLD_CHUNK) {
+            std::memcpy(buffer, payload.data(), OLD_CHUNK); // reply payload -> caller buffer
+            out.write(buffer, OLD_CHUNK);
+        }
+    }
+    report("download ofstream 4K", cpu_seconds() - cpu, wall_seconds() - wall, bytes);
+    std::remove(dst.c_str());
+
+    cpu = cpu_seconds(), wall = wall_seconds();
+    {
+        LocalSink out;
+        out.open(dst, true);
+        out.preallocate(bytes);
+        AlignedBuffer buffer(NEW_CHUNK);
+        for (uint64_t done = 0; done < bytes; done += NEW_CHUNK) {
+            std::memcpy(buffer.data(), payload.data(), NEW_CHUNK); // reply payload -> caller buffer
+            out.write_at(done, buffer.data(), NEW_CHUNK);
+        }
+        out.finish(bytes);
+    }
+    report("download pwrite 256K", cpu_seconds() - cpu, wall_seconds() - wall, bytes);
+
+    std::remove(dst.c_str());
+    std::remove(src.c_str());
+    return 0;
+}
@@ -0,0 +1,553 @@
+/**
+  end to end benchmark of the sftp_pip binary against a private sshd on localhost
+
+  sshd runs on a free port with its own host key, user key and config (internal-sftp),
+  an in-process proxy in front of it delays every chunk by delay-ms in each direction (a round trip costs 2x),
+  a fresh sftp_pip per shape is driven through the text protocol on its stdin/stdout
+
+  shapes (sizes times --scale):
+    many-tiny  2000 x 1 KiB in 20 directories, uploads/downloads
+    few-huge   4 x 64 MiB, uploads/downloads
+    deep-tree  depth 8 binary tree, 4 x 16 KiB per leaf directory, upload_dir/download_dir
+  per shape and direction: one batch request for files/s and MB/s,
+  then single-file requests over a sample of the files for p50/p99 per-file latency
+  peak RSS of the sftp_pip process comes from wait4 once it exits
+
+  usage: sftp_bench [--bin ./sftp_pip] [--sshd /usr/sbin/sshd] [--delay-ms 0] [--shape all] [--scale 1] [--pool 4] [--dir /tmp/sftp_bench]
+  prints one JSON object per line, per shape and direction
+  POSIX only, needs sshd and ssh-keygen
+*/
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pwd.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+// sftp_pip protocol, see src/sftp_pip_impl.h
+#define CMD_NEW_SESSION 0
+#define CMD_UPLOADS 1
+#define CMD_DOWNLOADS 2
+#define CMD_UPLOAD_DIR 5
+#define CMD_DOWNLOAD_DIR 6
+#define CMD_EXIT 100
+#define RES_ERROR_DONE -1
+#define RES_DONE 0
+#define RES_ERROR 2
+
+#define LATENCY_SAMPLES 200
+
+struct Config
+{
+    std::string bin = "./sftp_pip";
+    std::string sshd = "/usr/sbin/sshd";
+    std::string shape = "all";
+    std::string dir = "/tmp/sftp_bench";
+    int delay_ms = 0;
+    double scale = 1;
+    int pool = 4;
+};
+
+static void die(const char* what)
+{
+    std::perror(what);
+    std::exit(1);
+}
+
+static double seconds_since(Clock::time_point start) { return std::chrono::duration<double>(Clock::now() - start).count(); }
+
+// ---- sockets
+
+static int listen_local(int& port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) die("socket");
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(fd, (sockaddr*)&addr, sizeof(addr)) != 0) die("bind");
+    if (listen(fd, 64) != 0) die("listen");
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (sockaddr*)&addr, &len);
+    port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static int connect_local(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int free_port()
+{
+    int port = 0;
+    close(listen_local(port));
+    return port;
+}
+
+// ---- delay proxy
+
+/** one direction of a proxied connection, chunks leave delay after they arrived */
+struct DelayPipe
+{
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<std::pair<Clock::time_point, std::string>> chunks;
+    bool closed = false;
+};
+
+// both sockets close once the last of the four pump threads lets go
+struct ProxyConn
+{
+    ProxyConn(int client, int server) : client(client), server(server) {}
+    ProxyConn(const ProxyConn&) = delete;
+    int client, server;
+    ~ProxyConn()
+    {
+        close(client);
+        close(server);
+    }
+};
+
+static void pump(std::shared_ptr<ProxyConn> conn, int from, int to, int delay_ms)
+{
+    auto queue = std::make_shared<DelayPipe>();
+    std::thread writer([conn, queue, to] {
+        for (;;) {
+            std::pair<Clock::time_point, std::string> chunk;
+            {
+                std::unique_lock<std::mutex> lock(queue->mutex);
+                queue->condition.wait(lock, [&] { return !queue->chunks.empty() || queue->closed; });
+                if (queue->chunks.empty()) break;
+                chunk = std::move(queue->chunks.front());
+                queue->chunks.pop_front();
+            }
+            std::this_thread::sleep_until(chunk.first);
+            for (size_t done = 0; done < chunk.second.size();) {
+                auto n = write(to, chunk.second.data() + done, chunk.second.size() - done);
+                if (n <= 0) return;
+                done += n;
+            }
+        }
+        shutdown(to, SHUT_WR);
+    });
+
+    char buffer[64 * 1024];
+    ssize_t n;
+    while ((n = read(from, buffer, sizeof(buffer))) > 0) {
+        {
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            queue->chunks.emplace_back(Clock::now() + std::chrono::milliseconds(delay_ms), std::string(buffer, n));
+        }
+        queue->condition.notify_one();
+    }
+    {
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        queue->closed = true;
+    }
+    queue->condition.notify_one();
+    writer.join();
+}
+
+// accepts on a free port and forwards to target_port, returns the proxy port
+static int start_proxy(int target_port, int delay_ms)
+{
+    int port = 0;
+    int listener = listen_local(port);
+    std::thread([listener, target_port, delay_ms] {
+        for (;;) {
+            int client = accept(listener, nullptr, nullptr);
+            if (client < 0) continue;
+            int server = connect_local(target_port);
+            if (server < 0) {
+                close(client);
+                continue;
+            }
+            int one = 1;
+            setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            setsockopt(server, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            auto conn = std::make_shared<ProxyConn>(client, server);
+            std::thread(pump, conn, client, server, delay_ms).detach();
+            std::thread(pump, conn, server, client, delay_ms).detach();
+        }
+    }).detach();
+    return port;
+}
+
+// ---- sshd
+
+static void run(const std::string& command)
+{
+    if (std::system(command.c_str()) != 0) {
+        std::fprintf(stderr, "failed: %s\n", command.c_str());
+        std::exit(1);
+    }
+}
+
+static pid_t start_sshd(const Config& cfg, const fs::path& dir, int port)
+{
+    auto host_key = dir / "host_key", user_key = dir / "user_key";
+    if (!fs::exists(host_key)) run("ssh-keygen -q -t ed25519 -N '' -f " + host_key.string());
+    if (!fs::exists(user_key)) run("ssh-keygen -q -t ed25519 -N '' -f " + user_key.string());
+    fs::copy_file(user_key.string() + ".pub", dir / "authorized_keys", fs::copy_options::overwrite_existing);
+    fs::permissions(dir / "authorized_keys", fs::perms::owner_read | fs::perms::owner_write);
+
+    auto config = dir / "sshd_config";
+    {
+        std::ofstream out(config, std::ios::trunc);
+        out << "Port " << port << "\n"
+            << "ListenAddress 127.0.0.1\n"
+            << "HostKey " << host_key.string() << "\n"
+            << "PidFile " << (dir / "sshd.pid").string() << "\n"
+            << "AuthorizedKeysFile " << (dir / "authorized_keys").string() << "\n"
+            << "PasswordAuthentication no\n"
+            << "KbdInteractiveAuthentication no\n"
+            << "UsePAM no\n"
+            << "StrictModes no\n"
+            << "Subsystem sftp internal-sftp\n";
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) die("fork");
+    if (pid == 0) {
+        int log = open((dir / "sshd.log").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (log >= 0) dup2(log, STDERR_FILENO);
+        execl(cfg.sshd.c_str(), cfg.sshd.c_str(), "-D", "-e", "-f", config.c_str(), (char*)nullptr);
+        _exit(127);
+    }
+
+    for (int i = 0; i < 100; ++i) {
+        int fd = connect_local(port);
+        if (fd >= 0) {
+            close(fd);
+            return pid;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    std::fprintf(stderr, "sshd did not come up, see %s\n", (dir / "sshd.log").c_str());
+    kill(pid, SIGTERM);
+    std::exit(1);
+}
+
+// ---- sftp_pip client
+
+struct Response
+{
+    int cmd = 0, id = 0, status = 0;
+    std::vector<std::string> body;
+};
+
+class Pip
+{
+  public:
+    void start(const std::string& bin)
+    {
+        int in[2], out[2];
+        if (pipe(in) != 0 || pipe(out) != 0) die("pipe");
+        pid = fork();
+        if (pid < 0) die("fork");
+        if (pid == 0) {
+            dup2(in[0], STDIN_FILENO);
+            dup2(out[1], STDOUT_FILENO);
+            close(in[1]);
+            close(out[0]);
+            execl(bin.c_str(), bin.c_str(), (char*)nullptr);
+            _exit(127);
+        }
+        close(in[0]);
+        close(out[1]);
+        to = fdopen(in[1], "w");
+        from = fdopen(out[0], "r");
+        Response hello;
+        if (!read(hello)) {
+            std::fprintf(stderr, "%s did not say hello\n", bin.c_str());
+            std::exit(1);
+        }
+    }
+
+    // a blank line ends the request, "#" stands for an empty line
+    int send(int cmd, int session, const std::vector<std::string>& lines)
+    {
+        int id = ++last_id;
+        std::fprintf(to, "%d %d %d\n", cmd, id, session);
+        for (auto& line : lines) std::fprintf(to, "%s\n", line.empty() ? "#" : line.c_str());
+        std::fprintf(to, "\n");
+        std::fflush(to);
+        return id;
+    }
+
+    bool read(Response& res)
+    {
+        std::string line;
+        if (!read_line(line)) return false;
+        res.body.clear();
+        if (std::sscanf(line.c_str(), "%d %d %d", &res.cmd, &res.id, &res.status) != 3) return false;
+        while (read_line(line) && !line.empty()) res.body.push_back(line);
+        return true;
+    }
+
+    // waits for the final response of request id, counts per-file errors on the way
+    bool wait(int id, Response& res, int* errors = nullptr)
+    {
+        while (read(res)) {
+            if (res.id != id) continue;
+            if (res.status == RES_ERROR && errors) (*errors)++;
+            if (res.status == RES_DONE || res.status == RES_ERROR_DONE) return true;
+        }
+        return false;
+    }
+
+    // peak RSS in KiB
+    long finish()
+    {
+        send(CMD_EXIT, 0, {});
+        fclose(to);
+        int status = 0;
+        struct rusage usage{};
+        wait4(pid, &status, 0, &usage);
+        fclose(from);
+        return usage.ru_maxrss;
+    }
+
+  private:
+    bool read_line(std::string& line)
+    {
+        line.clear();
+        int c;
+        while ((c = std::fgetc(from)) != EOF && c != '\n') line += (char)c;
+        return c != EOF || !line.empty();
+    }
+
+    pid_t pid = -1;
+    FILE* to = nullptr;
+    FILE* from = nullptr;
+    int last_id = 0;
+};
+
+// ---- file sets
+
+struct Shape
+{
+    std::string name;
+    std::vector<std::string> files; // relative paths
+    uint64_t bytes = 0;
+    bool tree = false; // driven with upload_dir/download_dir
+};
+
+// incompressible content, so transport compression does not flatter the numbers
+static void write_file(const fs::path& path, uint64_t size, uint64_t seed)
+{
+    fs::create_directories(path.parent_path());
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    std::vector<uint64_t> block(8192);
+    uint64_t x = seed * 0x9E3779B97F4A7C15ull + 1;
+    for (uint64_t done = 0; done < size;) {
+        for (auto& v : block) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            v = x;
+        }
+        auto n = std::min<uint64_t>(size - done, block.size() * sizeof(uint64_t));
+        out.write((const char*)block.data(), n);
+        done += n;
+    }
+}
+
+static void add_file(Shape& shape, const fs::path& root, const std::string& rel, uint64_t size)
+{
+    if (!fs::exists(root / rel) || fs::file_size(root / rel) != size) write_file(root / rel, size, shape.files.size());
+    shape.files.push_back(rel);
+    shape.bytes += size;
+}
+
+static void deep_tree(Shape& shape, const fs::path& root, const std::string& prefix, int depth, int files, uint64_t size)
+{
+    if (depth == 0) {
+        for (int i = 0; i < files; ++i) add_file(shape, root, prefix + "f" + std::to_string(i), size);
+        return;
+    }
+    deep_tree(shape, root, prefix + "l" + std::to_string(depth) + "a/", depth - 1, files, size);
+    deep_tree(shape, root, prefix + "l" + std::to_string(depth) + "b/", depth - 1, files, size);
+}
+
+static Shape make_shape(const std::string& name, const fs::path& root, double scale)
+{
+    Shape shape;
+    shape.name = name;
+    if (name == "many-tiny") {
+        int count = std::max(1, (int)(2000 * scale));
+        for (int i = 0; i < count; ++i) add_file(shape, root, "d" + std::to_string(i % 20) + "/f" + std::to_string(i), 1024);
+    } else if (name == "few-huge") {
+        auto size = std::max<uint64_t>(1, (uint64_t)(64.0 * 1024 * 1024 * scale));
+        for (int i = 0; i < 4; ++i) add_file(shape, root, "huge" + std::to_string(i), size);
+    } else {
+        shape.tree = true;
+        deep_tree(shape, root, "", 8, std::max(1, (int)(4 * scale)), 16 * 1024);
+    }
+    return shape;
+}
+
+// ---- measurements
+
+static double percentile(std::vector<double> values, double p)
+{
+    if (values.empty()) return 0;
+    std::sort(values.begin(), values.end());
+    auto i = (size_t)std::min<double>(values.size() - 1, p * (values.size() - 1) + 0.5);
+    return values[i];
+}
+
+struct Result
+{
+    double seconds = 0;
+    int errors = 0;
+    bool complete = false;
+    std::vector<double> latency_ms;
+};
+
+static void report(const Config& cfg, const Shape& shape, const char* direction, const Result& result, long rss_kb)
+{
+    std::printf("{\"shape\":\"%s\",\"direction\":\"%s\",\"files\":%zu,\"bytes\":%llu,\"seconds\":%.3f,\"files_per_s\":%.1f,\"mb_per_s\":%.2f,"
+                "\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"errors\":%d,\"complete\":%s,\"peak_rss_kb\":%ld,\"delay_ms\":%d,\"pool\":%d}\n",
+                shape.name.c_str(), direction, shape.files.size(), (unsigned long long)shape.bytes, result.seconds,
+                result.seconds > 0 ? shape.files.size() / result.seconds : 0.0,
+                result.seconds > 0 ? shape.bytes / (1024.0 * 1024.0) / result.seconds : 0.0, percentile(result.latency_ms, 0.5),
+                percentile(result.latency_ms, 0.99), result.errors, result.complete ? "true" : "false", rss_kb, cfg.delay_ms, cfg.pool);
+    std::fflush(stdout);
+}
+
+static Result transfer(Pip& pip, int session, const Shape& shape, const fs::path& local, const fs::path& remote, bool upload)
+{
+    Result result;
+    std::vector<std::string> lines{local.string(), remote.string()};
+    int cmd = upload ? CMD_UPLOADS : CMD_DOWNLOADS;
+    if (shape.tree) {
+        cmd = upload ? CMD_UPLOAD_DIR : CMD_DOWNLOAD_DIR;
+    } else {
+        lines.insert(lines.end(), shape.files.begin(), shape.files.end());
+    }
+
+    auto start = Clock::now();
+    Response res;
+    int id = pip.send(cmd, session, lines);
+    result.complete = pip.wait(id, res, &result.errors) && res.status == RES_DONE;
+    result.seconds = seconds_since(start);
+
+    // one request per file, request to final response
+    auto step = std::max<size_t>(shape.files.size() / LATENCY_SAMPLES, 1);
+    for (size_t i = 0; i < shape.files.size(); i += step) {
+        auto file_start = Clock::now();
+        id = pip.send(upload ? CMD_UPLOADS : CMD_DOWNLOADS, session, {local.string(), remote.string(), shape.files[i]});
+        if (!pip.wait(id, res)) break;
+        result.latency_ms.push_back(seconds_since(file_start) * 1e3);
+    }
+    return result;
+}
+
+static void bench_shape(const Config& cfg, const fs::path& dir, const std::string& name, int port, const std::string& user)
+{
+    auto local = dir / "local" / name;
+    auto remote = dir / "remote" / name;
+    auto back = dir / "back" / name;
+    auto shape = make_shape(name, local, cfg.scale);
+    fs::remove_all(remote);
+    fs::remove_all(back);
+
+    Pip pip;
+    pip.start(cfg.bin);
+    Response res;
+    int id = pip.send(CMD_NEW_SESSION, 0,
+                      {"127.0.0.1", user, "", std::to_string(port), "pool=" + std::to_string(cfg.pool), "identity=" + (dir / "user_key").string()});
+    if (!pip.wait(id, res) || res.status != RES_DONE || res.body.empty()) {
+        std::fprintf(stderr, "new_session failed\n");
+        for (auto& line : res.body) std::fprintf(stderr, "  %s\n", line.c_str());
+        std::exit(1);
+    }
+    int session = std::atoi(res.body[0].c_str());
+
+    auto up = transfer(pip, session, shape, local, remote, true);
+    auto down = transfer(pip, session, shape, back, remote, false);
+    long rss_kb = pip.finish();
+
+    // RSS is the process peak over both directions
+    report(cfg, shape, "upload", up, rss_kb);
+    report(cfg, shape, "download", down, rss_kb);
+}
+
+int main(int argc, char** argv)
+{
+    Config cfg;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string arg = argv[i];
+        std::string value = argv[i + 1];
+        if (arg == "--bin") cfg.bin = value;
+        else if (arg == "--sshd") cfg.sshd = value;
+        else if (arg == "--delay-ms") cfg.delay_ms = std::atoi(value.c_str());
+        else if (arg == "--shape") cfg.shape = value;
+        else if (arg == "--scale") cfg.scale = std::atof(value.c_str());
+        else if (arg == "--pool") cfg.pool = std::max(1, std::atoi(value.c_str()));
+        else if (arg == "--dir") cfg.dir = value;
+        else {
+            std::fprintf(stderr, "unknown option %s\n", arg.c_str());
+            return 1;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    auto dir = fs::absolute(cfg.dir);
+    fs::create_directories(dir);
+    cfg.bin = fs::absolute(cfg.bin).string();
+
+    auto* pw = getpwuid(getuid());
+    std::string user = pw ? pw->pw_name : "root";
+
+    int sshd_port = free_port();
+    pid_t sshd = start_sshd(cfg, dir, sshd_port);
+    int port = start_proxy(sshd_port, cfg.delay_ms);
+
+    std::vector<std::string> shapes{"many-tiny", "few-huge", "deep-tree"};
+    for (auto& name : shapes) {
+        if (cfg.shape == "all" || cfg.shape == name) bench_shape(cfg, dir, name, port, user);
+    }
+
+    kill(sshd, SIGTERM);
+    waitpid(sshd, nullptr, 0);
+    return 0;
+}
@@ -10,34 +10,219 @@
 #include <algorithm>
 #include <csignal>
 #include <cstddef>
+#include <cstdint>
 #include <cstdlib>
 #include <iostream>
 #include <atomic>
+#include <condition_variable>
+#include <memory>
 #include <mutex>
 #include <queue>
+#include <sstream>
 #include <string>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include "libssh/libssh.h"
 #include "sftp_pip_impl.h"
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
 
 std::atomic<bool> running(true);
 void signal_handler(int signal) { running = false; }
 
-void process_handle(std::vector<std::string>& msgs);
+void process_handle(Msgs& msgs, long long queued_us);
+
+// tasks of one session run in order, one at a time, tasks without a session run freely
+// a task over several sessions (fan-out) waits until it is first in line on each of them
+#define NO_SESSION_KEY -1
+
+/** runnable tasks go by priority, then arrival
+ * a head option "priority=N" overrides the guess from the request shape, higher first
+ */
+enum
+{
+    PRIORITY_BULK = 0,        // batches of many files, trees
+    PRIORITY_NORMAL = 1,      // sessions, metadata
+    PRIORITY_INTERACTIVE = 2, // a few files, an editor saving
+};
+
+// uploads/downloads of up to this many files count as interactive
+#define INTERACTIVE_FILES 4
 
 struct Task
 {
     Task() = default;
-    Task(std::vector<std::string>&& args) : args(std::move(args)) {}
-    std::vector<std::string> args;
+    Task(std::vector<char>&& buffer, Msgs&& args, std::vector<int>&& keys, int priority)
+        : buffer(std::move(buffer)), args(std::move(args)), keys(std::move(keys)), priority(priority)
+    {
+    }
+    std::vector<char> buffer; // args are views into it, a moved vector keeps its storage
+    Msgs args;
+    std::vector<int> keys; // sessions the task holds while it runs, none for NO_SESSION_KEY
+    int missing = 0;       // keys still held by earlier tasks, set by push_task
+    int priority = PRIORITY_NORMAL;
+    unsigned long long seq = 0; // arrival, set by push_task
+    std::chrono::steady_clock::time_point queued = std::chrono::steady_clock::now();
+};
+
+class TaskHeap
+{
+  public:
+    bool empty() const { return tasks.empty(); }
+
+    void push(Task&& task)
+    {
+        tasks.emplace_back(std::move(task));
+        std::push_heap(tasks.begin(), tasks.end(), before);
+    }
+
+    Task pop()
+    {
+        std::pop_heap(tasks.begin(), tasks.end(), before);
+        Task task = std::move(tasks.back());
+        tasks.pop_back();
+        return task;
+    }
+
+  private:
+    // heap order: "a runs after b"
+    static bool before(const Task& a, const Task& b) { return a.priority != b.priority ? a.priority < b.priority : a.seq > b.seq; }
+    std::vector<Task> tasks;
 };
 
 std::mutex cout_mutex;
 
 std::mutex taskQueue_mutex;
-std::queue<Task> taskQueue;
+TaskHeap taskQueue; // runnable tasks, their sessions are marked busy
+unsigned long long taskSeq = 0;
 std::condition_variable taskQueue_condition;
+int activeTasks = 0;   // popped by a worker, not finished yet
+bool exiting = false;  // CMD_EXIT seen, later tasks (watch, keepalive) are dropped
+std::condition_variable idle_condition; // activeTasks or the queues went down
+std::unordered_set<int> busySessions;
+// waiting behind the running task of their session, a fan-out task sits in the queue of each of its sessions
+std::unordered_map<int, std::queue<std::shared_ptr<Task>>> sessionQueues;
+
+int task_key(const Msgs& args)
+{
+    if (args.empty()) { return NO_SESSION_KEY; }
+    int cmd = -1, id = 0, sessionId = NO_SESSION_KEY;
+    std::istringstream iss{std::string(args[0])};
+    iss >> cmd >> id >> sessionId;
+    switch (cmd) {
+    case CMD_UPLOADS:
+    case CMD_DOWNLOADS:
+    case CMD_UPLOAD_DIR:
+    case CMD_DOWNLOAD_DIR:
+    case CMD_STAT:
+    case CMD_REMOVE:
+    case CMD_RENAME:
+    case CMD_MKDIR:
+    case CMD_READDIR:
+    case CMD_WATCH:
+    case CMD_UNWATCH:
+    case CMD_PING:
+    case CMD_CLOSE_SESSION:
+        return sessionId;
+    default:
+        return NO_SESSION_KEY;
+    }
+}
+
+// fan-out holds every target session, see fanout_uploads
+std::vector<int> task_keys(const Msgs& args)
+{
+    int cmd = -1;
+    if (!args.empty()) std::istringstream{std::string(args[0])} >> cmd;
+    std::vector<int> keys;
+    if (cmd == CMD_FANOUT && args.size() > 1) {
+        std::istringstream iss{std::string(args[1])};
+        for (int key; iss >> key;) {
+            if (std::find(keys.begin(), keys.end(), key) == keys.end()) keys.push_back(key);
+        }
+        return keys;
+    }
+    int key = task_key(args);
+    if (key != NO_SESSION_KEY) keys.push_back(key);
+    return keys;
+}
+
+int task_priority(const Msgs& args)
+{
+    int cmd = -1, id = 0, sessionId = 0;
+    std::istringstream iss{std::string(args[0])};
+    iss >> cmd >> id >> sessionId;
+    std::string token;
+    while (iss >> token) {
+        if (token.rfind("priority=", 0) == 0) { return std::atoi(token.c_str() + 9); }
+    }
+    switch (cmd) {
+    case CMD_UPLOADS:
+    case CMD_DOWNLOADS:
+        return args.size() <= 3 + INTERACTIVE_FILES ? PRIORITY_INTERACTIVE : PRIORITY_BULK;
+    case CMD_UPLOAD_DIR:
+    case CMD_DOWNLOAD_DIR:
+    case CMD_FANOUT:
+        return PRIORITY_BULK;
+    default:
+        return PRIORITY_NORMAL;
+    }
+}
+
+// a session keeps its tasks in arrival order, a later one may depend on an earlier one,
+// priority only decides between sessions
+// keys are taken in arrival order under one lock, so tasks over several sessions cannot wait on each other in a cycle
+void push_task(Task&& task)
+{
+    {
+        std::lock_guard<std::mutex> lock(taskQueue_mutex);
+        if (exiting) { return; }
+        task.seq = taskSeq++;
+        std::shared_ptr<Task> waiting;
+        for (auto key : task.keys) {
+            if (busySessions.insert(key).second) { continue; }
+            if (!waiting) waiting = std::make_shared<Task>();
+            sessionQueues[key].push(waiting);
+            task.missing++;
+        }
+        if (waiting) {
+            *waiting = std::move(task);
+            return;
+        }
+        taskQueue.push(std::move(task));
+    }
+    taskQueue_condition.notify_one();
+}
+
+// hand each session to its next waiting task, or release it
+void finish_task(const std::vector<int>& keys)
+{
+    int runnable = 0;
+    {
+        std::lock_guard<std::mutex> lock(taskQueue_mutex);
+        activeTasks--;
+        for (auto key : keys) {
+            auto it = sessionQueues.find(key);
+            if (it == sessionQueues.end()) {
+                busySessions.erase(key);
+                continue;
+            }
+            auto next = std::move(it->second.front());
+            it->second.pop();
+            if (it->second.empty()) { sessionQueues.erase(it); }
+            if (--next->missing == 0) {
+                taskQueue.push(std::move(*next));
+                runnable++;
+            }
+        }
+    }
+    for (int i = 0; i < runnable; ++i) taskQueue_condition.notify_one();
+    idle_condition.notify_all();
+}
 
 // Remove leading and trailing whitespace from a string_view, return string
 std::string trim(std::string_view str)
@@ -64,24 +249,183 @@ void task_thread()
             std::unique_lock<std::mutex> lock(taskQueue_mutex);
             taskQueue_condition.wait(lock, [] { return !taskQueue.empty() || !running; });
             if (!running) { return; }
-            task = std::move(taskQueue.front());
-            taskQueue.pop();
+            task = taskQueue.pop();
+            activeTasks++;
         }
 
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        for (auto& arg : task.args)
-        {
-            if (trim(arg) == "#") { arg.clear(); }
-        }
-        process_handle(task.args);
+        auto queued_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - task.queued).count();
+        process_handle(task.args, queued_us);
+        finish_task(task.keys);
     }
 }
 
 
 #define SFTP_PIP_VERSION "version 0.0.7"
 
-int main()
+#define DEFAULT_WORKERS 4
+
+/**
+  framing, picked by the client with "99 <id> 0 framing=binary"
+
+  text (default): lines, a blank line ends a request, "#" is an empty line
+  binary: frame = u32 length + args, arg = u32 length + bytes, little endian,
+          one frame per request, a response is a frame of two args (head, body),
+          output is buffered and flushed when a request ends or OUT_FLUSH_MS later
+*/
+std::atomic<bool> binary_framing(false);
+std::string out_buffer; // binary responses not written yet, guarded by cout_mutex
+
+#define OUT_FLUSH_SIZE (64 * 1024)
+#define OUT_FLUSH_MS 5 // at most this long in out_buffer, lines without a DONE behind them (watch, warm, progress) go out too
+#define MAX_FRAME_SIZE (256u * 1024 * 1024)
+
+uint32_t load_u32(const unsigned char* p) { return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24; }
+
+void append_u32(std::string& out, uint32_t value)
+{
+    char bytes[4] = {(char)(value & 0xff), (char)(value >> 8 & 0xff), (char)(value >> 16 & 0xff), (char)(value >> 24 & 0xff)};
+    out.append(bytes, 4);
+}
+
+// one binary request, false on EOF or a malformed frame
+bool read_frame(std::istream& in, std::vector<char>& buffer, Msgs& args)
 {
+    unsigned char size_bytes[4];
+    if (!in.read((char*)size_bytes, 4)) { return false; }
+    uint32_t size = load_u32(size_bytes);
+    if (size > MAX_FRAME_SIZE) { return false; }
+    buffer.resize(size);
+    if (size && !in.read(buffer.data(), size)) { return false; }
+
+    args.clear();
+    size_t pos = 0;
+    while (pos < size) {
+        if (size - pos < 4) { return false; }
+        uint32_t len = load_u32((const unsigned char*)buffer.data() + pos);
+        pos += 4;
+        if (len > size - pos) { return false; }
+        args.emplace_back(buffer.data() + pos, len);
+        pos += len;
+    }
+    return true;
+}
+
+std::condition_variable out_condition; // out_buffer got something, with cout_mutex
+
+// binary framing: whatever sits in out_buffer is written OUT_FLUSH_MS after it arrived
+void flush_thread()
+{
+    std::unique_lock<std::mutex> lock(cout_mutex);
+    while (running) {
+        out_condition.wait(lock, [] { return !out_buffer.empty() || !running; });
+        // the rest of a request gets a moment to join the write
+        out_condition.wait_for(lock, std::chrono::milliseconds(OUT_FLUSH_MS), [] { return out_buffer.empty() || !running; });
+        if (out_buffer.empty()) { continue; }
+        std::cout.write(out_buffer.data(), out_buffer.size());
+        std::cout.flush();
+        out_buffer.clear();
+    }
+}
+
+void flush_output()
+{
+    std::lock_guard<std::mutex> lock(cout_mutex);
+    if (!out_buffer.empty()) {
+        std::cout.write(out_buffer.data(), out_buffer.size());
+        out_buffer.clear();
+    }
+    std::cout.flush();
+}
+
+// answered in the current framing, the switch applies from the next request on
+void handshake(const Msgs& args)
+{
+    ReqHead head;
+    get_req_head(args[0], head);
+    auto it = head.options.find("framing");
+    bool binary = it != head.options.end() && it->second == "binary";
+    response(CMD_READY, head.id, RES_DONE, binary ? "framing binary" : "framing text");
+    if (binary) {
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        static std::once_flag flusher;
+        std::call_once(flusher, [] { std::thread(flush_thread).detach(); });
+        binary_framing = true;
+    }
+}
+
+// answered once every earlier task has run, then main leaves its read loop and cleans up
+void drain_and_exit(const Msgs& args)
+{
+    ReqHead head;
+    get_req_head(args[0], head);
+    {
+        std::unique_lock<std::mutex> lock(taskQueue_mutex);
+        exiting = true;
+        idle_condition.wait(lock, [] { return taskQueue.empty() && sessionQueues.empty() && activeTasks == 0; });
+    }
+    // their submissions are dropped by now, joined they no longer read the sessions ssh_finalize tears down
+    stop_background();
+    response(CMD_EXIT, head.id, RES_DONE, "exit");
+    running = false;
+}
+
+void submit(std::vector<char>&& buffer, Msgs&& args)
+{
+    if (args.empty()) { return; }
+    // the reader has to know the framing of the next bytes, so READY is not queued
+    int cmd = -1;
+    std::istringstream{std::string(args[0])} >> cmd;
+    if (cmd == CMD_READY) {
+        handshake(args);
+        return;
+    }
+    // exit waits for everything before it, the reader takes no more requests meanwhile
+    if (cmd == CMD_EXIT) {
+        drain_and_exit(args);
+        return;
+    }
+    // status only reads counters, answering it here keeps it from waiting behind busy workers
+    if (cmd == CMD_STATUS_SESSION) {
+        process_handle(args, 0);
+        return;
+    }
+    auto keys = task_keys(args);
+    int priority = task_priority(args);
+    push_task(Task(std::move(buffer), std::move(args), std::move(keys), priority));
+}
+
+// see set_submitter, "#" needs no escaping here
+void submit_lines(const std::vector<std::string>& lines)
+{
+    std::vector<char> buffer;
+    std::vector<std::pair<size_t, size_t>> spans;
+    for (auto& line : lines) {
+        spans.emplace_back(buffer.size(), line.size());
+        buffer.insert(buffer.end(), line.begin(), line.end());
+    }
+    Msgs args;
+    for (auto& span : spans) args.emplace_back(buffer.data() + span.first, span.second);
+    submit(std::move(buffer), std::move(args));
+}
+
+int main(int argc, char** argv)
+{
+    // -j N / --workers N: tasks of different sessions run in parallel on N threads
+    // --warm [user@]host[:port]: connect and authenticate ahead of the first new_session, repeat for more connections
+    // --rate N: bytes per second over all transfers ("10M", "512K")
+    int workers = DEFAULT_WORKERS;
+    std::vector<std::string> warm;
+    for (int i = 1; i + 1 < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-j" || arg == "--workers") { workers = std::max(1, std::atoi(argv[++i])); }
+        else if (arg == "--warm") { warm.emplace_back(argv[++i]); }
+        else if (arg == "--rate") { set_global_rate(argv[++i]); }
+    }
+
+
 #ifdef _WIN32
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
@@ -90,30 +434,56 @@ int main()
     std::signal(SIGTERM, signal_handler);
 #endif
     ssh_init();
+    set_submitter(submit_lines);
 
-    std::thread worker(task_thread);
-    worker.detach();
+    for (int i = 0; i < workers; ++i) {
+        std::thread worker(task_thread);
+        worker.detach();
+    }
 
     std::string line;
-    std::vector<std::string> msgs;
+    std::vector<char> buffer;
+    std::vector<std::pair<size_t, size_t>> lines; // offset and length in buffer
     response(CMD_READY, 0, RES_HELLO, SFTP_PIP_VERSION);
-    while (running && std::getline(std::cin, line))
+
+    // in parallel with the first requests, a new_session that comes first just connects itself
+    for (auto& spec : warm) {
+        std::thread warmer(warm_connection, spec, response);
+        warmer.detach();
+    }
+    while (running)
     {
-        if (std::cin.eof()) { break; }
+        if (binary_framing) {
+            Msgs args;
+            if (!read_frame(std::cin, buffer, args)) { break; }
+            submit(std::move(buffer), std::move(args));
+            buffer = std::vector<char>();
+            continue;
+        }
+
+        if (!std::getline(std::cin, line) || std::cin.eof()) { break; }
 
         if (line == "")
         {
-            {
-                std::lock_guard<std::mutex> lock(taskQueue_mutex);
-                taskQueue.emplace(std::move(msgs));
-            }
-            taskQueue_condition.notify_one();
+            // views are taken once the buffer stops growing
+            Msgs args;
+            for (auto& l : lines) args.emplace_back(buffer.data() + l.first, l.second);
+            submit(std::move(buffer), std::move(args));
+            buffer = std::vector<char>();
+            lines.clear();
+        }
+        else if (trim(line) == "#") { lines.emplace_back(buffer.size(), 0); }
+        else {
+            lines.emplace_back(buffer.size(), line.size());
+            buffer.insert(buffer.end(), line.begin(), line.end());
         }
-        else { msgs.emplace_back(line); }
     }
 
     running = false;
+    stop_background(); // stdin closed without CMD_EXIT
     taskQueue_condition.notify_all();
+    out_condition.notify_all();
+    flush_output();
     ssh_finalize();
     return 0;
 }
@@ -121,18 +491,40 @@ int main()
 // std::mutex cout_mutex;
 void response(int cmd, int id, int status, const std::string& response)
 {
+    if (binary_framing) {
+        auto head = fmt::format("{} {} {}", cmd, id, status);
+        std::lock_guard<std::mutex> lock(cout_mutex);
+        append_u32(out_buffer, (uint32_t)(8 + head.size() + response.size()));
+        append_u32(out_buffer, (uint32_t)head.size());
+        out_buffer += head;
+        append_u32(out_buffer, (uint32_t)response.size());
+        out_buffer += response;
+        // per-file lines wait for the end of their request unless enough piled up or OUT_FLUSH_MS passed
+        if (status == RES_DONE || status == RES_ERROR_DONE || status == RES_ERROR || out_buffer.size() >= OUT_FLUSH_SIZE) {
+            std::cout.write(out_buffer.data(), out_buffer.size());
+            std::cout.flush();
+            out_buffer.clear();
+        } else {
+            out_condition.notify_one(); // see flush_thread
+        }
+        return;
+    }
+
     std::lock_guard<std::mutex> lock(cout_mutex);
     auto res = fmt::format("{} {} {}\n{}\n\n", cmd, id, status, response =="" ? "#" : response);
     std::cout << res << std::flush;
 }
 
-void process_handle(std::vector<std::string>& msgs)
+void process_handle(Msgs& msgs, long long queued_us)
 {
 
     if (msgs.size() < 1) { return; }
     ReqHead head;
     std::string msg = "";
     get_req_head(msgs[0], head);
+    head.queued_us = queued_us;
+    // status runs on the reader thread, pings do not count as use
+    if (head.cmd != CMD_STATUS_SESSION && head.cmd != CMD_PING) touch_session(head.sessionId);
     switch (head.cmd)
     {
     case CMD_NEW_SESSION:
@@ -144,14 +536,46 @@ void process_handle(std::vector<std::string>& msgs)
     case CMD_DOWNLOADS:
         downloads(head, msgs, response);
         break;
+    case CMD_UPLOAD_DIR:
+        upload_dir(head, msgs, response);
+        break;
+    case CMD_DOWNLOAD_DIR:
+        download_dir(head, msgs, response);
+        break;
+    case CMD_STATUS_SESSION:
+        status_session(head, msgs, response);
+        break;
+    case CMD_STAT:
+        remote_stat(head, msgs, response);
+        break;
+    case CMD_REMOVE:
+        remote_remove(head, msgs, response);
+        break;
+    case CMD_RENAME:
+        remote_rename(head, msgs, response);
+        break;
+    case CMD_MKDIR:
+        remote_mkdir(head, msgs, response);
+        break;
+    case CMD_READDIR:
+        remote_readdir(head, msgs, response);
+        break;
+    case CMD_WATCH:
+        watch_dir(head, msgs, response);
+        break;
+    case CMD_FANOUT:
+        fanout_uploads(head, msgs, response);
+        break;
+    case CMD_PING:
+        ping_session(head, msgs, response);
+        break;
+    case CMD_UNWATCH:
+        unwatch_dir(head, msgs, response);
+        break;
     case CMD_CLOSE_SESSION:
         close_session(head, msgs, response);
         break;
-    case CMD_EXIT:
-        response(CMD_EXIT, head.id, RES_DONE, "exit");
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        running = false;
-        std::exit(0);
+    case CMD_EXIT: // answered on the reader thread, see drain_and_exit
         break;
     }
 };
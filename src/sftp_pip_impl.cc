@@ -1,17 +1,246 @@
 #include "sftp_pip_impl.h"
+#include "sftp_pip_local_io.h"
 #include "libssh/libssh.h"
 
-#include <fstream>
+#include <cstring>
 #include <sstream>
 #include <stack>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <fcntl.h>
 #include <thread>
 
 #include <libssh/sftp.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+#include <openssl/evp.h>
+#include <zlib.h>
 #include <fmt/format.h>
 #include <valarray>
+#include <algorithm>
+#include <chrono>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+// async sftp requests (sftp_aio_*) and sftp_limits() arrived in libssh 0.11
+#if LIBSSH_VERSION_INT >= SSH_VERSION_INT(0, 11, 0)
+#define SFTP_PIP_AIO 1
+#else
+#define SFTP_PIP_AIO 0
+#endif
+
+// sftp v3 servers must accept at least 32 KiB per read/write request
+#define SFTP_MIN_IO_LENGTH (32 * 1024)
+
+// libssh timeout for connecting and for each blocking call, see session_init
+#define SSH_TIMEOUT_SEC 10
+
+using Clock = std::chrono::steady_clock;
+
+long long elapsed_us(Clock::time_point since) { return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - since).count(); }
+
+/** remote directories known to exist, shared by a session and its lanes
+ * filled by stat/mkdir in ensure_remote_dir, cleared on reconnect
+ */
+struct DirCache
+{
+    std::mutex mutex;
+    std::unordered_set<std::string> dirs;
+
+    bool has(const std::string& dir)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return dirs.count(dir) > 0;
+    }
+
+    // the parents of an existing directory exist too
+    void add(std::string dir)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        while (!dir.empty() && dirs.insert(dir).second) {
+            auto i = dir.find_last_of('/');
+            if (i == std::string::npos || i == 0) { break; }
+            dir.erase(i);
+        }
+    }
+
+    // dir turned out to be missing, so are the cached claims about it and its parents
+    void forget(std::string dir)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        while (!dir.empty()) {
+            dirs.erase(dir);
+            auto i = dir.find_last_of('/');
+            if (i == std::string::npos || i == 0) { break; }
+            dir.erase(i);
+        }
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        dirs.clear();
+    }
+};
+
+/** where one connection is in its current file, see TransferStats */
+struct LaneProgress
+{
+    std::atomic<uint64_t> offset{0};
+    std::atomic<uint64_t> size{0};
+    std::atomic<uint64_t>* bytes = nullptr; // TransferStats::bytes of the session
+    std::mutex mutex;                       // guards file, set once per file
+    std::string file;
+
+    void begin(std::string_view path)
+    {
+        offset = 0;
+        size = 0;
+        std::lock_guard<std::mutex> lock(mutex);
+        file = path;
+    }
+
+    void end() { begin(""); }
+
+    // the transfer knows the range once the file is open
+    void at(uint64_t position, uint64_t total)
+    {
+        offset.store(position, std::memory_order_relaxed);
+        size.store(total, std::memory_order_relaxed);
+    }
+
+    void advance(uint64_t position, uint64_t n)
+    {
+        offset.store(position, std::memory_order_relaxed);
+        bytes->fetch_add(n, std::memory_order_relaxed);
+    }
+};
+
+/** live numbers of a session and its lanes, read by status_session while a transfer runs
+ * the transfer loops only touch atomics, the mutex guards the lane list and the rate sample
+ */
+struct TransferStats
+{
+    std::atomic<uint64_t> bytes{0}; // file data moved since the session opened
+    std::atomic<int> done{0};
+    std::atomic<int> failed{0};
+    std::atomic<int> pending{0}; // queued by the running batch, not finished yet
+    std::atomic<int> reconnects{0};
+    std::atomic<long long> reconnect_us{0};       // the last reconnect took
+    std::atomic<long long> reconnect_total_us{0};
+    std::atomic<long long> used_us{0};            // since opened, the last request of the session came in
+    std::atomic<int> pings{0};                    // keepalive probes sent
+    std::atomic<bool> ping_queued{false};
+    std::atomic<bool> busy{false};
+    std::atomic<long long> busy_us{0};       // finished batches
+    std::atomic<long long> batch_start_us{0}; // since opened, valid while busy
+    Clock::time_point opened = Clock::now();
+
+    std::mutex mutex;
+    std::vector<std::shared_ptr<LaneProgress>> lanes;
+    uint64_t sample_bytes = 0; // at the last status_session, for the instantaneous rate
+    Clock::time_point sample_at = opened;
+
+    std::shared_ptr<LaneProgress> add_lane()
+    {
+        auto lane = std::make_shared<LaneProgress>();
+        lane->bytes = &bytes;
+        std::lock_guard<std::mutex> lock(mutex);
+        lanes.push_back(lane);
+        return lane;
+    }
+};
+
+/** bytes per second shared by everyone who takes from it, see throttle
+ * a taker books its bytes and sleeps off the debt, so concurrent lanes line up instead of bursting
+ */
+class TokenBucket
+{
+  public:
+    explicit TokenBucket(uint64_t rate) : rate((double)rate), burst(std::max<double>(rate / 10.0, 64 * 1024)), tokens(burst), last(Clock::now()) {}
+
+    void take(uint64_t n)
+    {
+        double debt;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            refill();
+            tokens -= (double)n;
+            debt = -tokens;
+        }
+        if (debt > 0) std::this_thread::sleep_for(std::chrono::duration<double>(debt / rate));
+    }
+
+    // without waiting: false while in debt, otherwise the bytes are booked
+    bool try_take(uint64_t n)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        refill();
+        if (tokens <= 0) { return false; }
+        tokens -= (double)n;
+        return true;
+    }
+
+    bool ready()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        refill();
+        return tokens > 0;
+    }
+
+  private:
+    void refill()
+    {
+        auto now = Clock::now();
+        tokens = std::min(burst, tokens + std::chrono::duration<double>(now - last).count() * rate);
+        last = now;
+    }
+
+    std::mutex mutex;
+    double rate;
+    double burst;
+    double tokens;
+    Clock::time_point last;
+};
+
+// "10M", "512K", "1G" or plain bytes, 0 when empty or unreadable
+uint64_t parse_bytes(const std::string& value)
+{
+    char* end = nullptr;
+    double n = std::strtod(value.c_str(), &end);
+    if (!end || end == value.c_str() || n <= 0) { return 0; }
+    switch (*end) {
+    case 'k':
+    case 'K':
+        n *= 1024;
+        break;
+    case 'm':
+    case 'M':
+        n *= 1024 * 1024;
+        break;
+    case 'g':
+    case 'G':
+        n *= 1024.0 * 1024 * 1024;
+        break;
+    }
+    return (uint64_t)n;
+}
+
+std::unique_ptr<TokenBucket> global_rate; // --rate, set once before the workers start
+
+void set_global_rate(const std::string& rate)
+{
+    auto bytes = parse_bytes(rate);
+    global_rate.reset(bytes ? new TokenBucket(bytes) : nullptr);
+}
 
 struct SFTPSession
 {
@@ -22,6 +251,26 @@ struct SFTPSession
     std::string uname;
     std::string password;
     bool is_login;
+    Options options;
+    uint64_t max_write; // server limits, see session_init
+    uint64_t max_read;
+    std::vector<SFTPSession> lanes; // extra connections for concurrent transfers, see run_batch
+    std::shared_ptr<DirCache> dirs;
+    std::string pool_key;           // host/port/user as requested, see ConnPool
+    Clock::time_point requested;    // new_session request arrived
+    std::shared_ptr<std::atomic<bool>> first_byte; // shared with the lanes, see note_first_byte
+    std::shared_ptr<TransferStats> stats;          // shared with the lanes
+    std::shared_ptr<LaneProgress> progress;        // this connection's entry in stats
+    int compress = -1;                             // -1 ssh config, 0 off, 1-9 zlib level, see apply_transport_options
+    std::shared_ptr<TokenBucket> rate;             // "rate" option, shared with the lanes
+    std::shared_ptr<struct StripeSet> stripes;     // shared with the lanes, see transfer_striped
+};
+
+// extra connections for one striped file at a time, whichever lane has the large file takes them
+struct StripeSet
+{
+    std::mutex busy;
+    std::vector<SFTPSession> conns;
 };
 
 struct Err
@@ -48,7 +297,7 @@ struct Err
     {
         Err err;
         err.err = 2;
-        err._code = code == 0 ? 14 : 0;
+        err._code = code == 0 ? 14 : code;
         return err;
     }
     bool isSftpErr()const { return err == 2; }
@@ -56,11 +305,40 @@ struct Err
     int code()const {return _code;}
 };
 
+// workers run different sessions in parallel, the scheduler keeps one task per session at a time,
+// so the mutex only guards the map itself, not the sessions in it
+std::mutex sftp_sessions_mutex;
 std::unordered_map<int, SFTPSession> sftp_sessions;
 int session_count = 0;
 
+SFTPSession* find_session(int sessionId)
+{
+    std::lock_guard<std::mutex> lock(sftp_sessions_mutex);
+    auto it = sftp_sessions.find(sessionId);
+    return it == sftp_sessions.end() ? nullptr : &it->second;
+}
+
+// stays valid when the session is closed meanwhile, unlike find_session
+void touch_session(int sessionId)
+{
+    std::lock_guard<std::mutex> lock(sftp_sessions_mutex);
+    auto it = sftp_sessions.find(sessionId);
+    if (it != sftp_sessions.end() && it->second.stats) it->second.stats->used_us = elapsed_us(it->second.stats->opened);
+}
+
+std::shared_ptr<TransferStats> find_stats(int sessionId)
+{
+    std::lock_guard<std::mutex> lock(sftp_sessions_mutex);
+    auto it = sftp_sessions.find(sessionId);
+    return it == sftp_sessions.end() ? nullptr : it->second.stats;
+}
+
 void clear_login(SFTPSession& session)
 {
+    if (session.sftp) {
+        sftp_free(session.sftp);
+        session.sftp = nullptr;
+    }
     if (session.ssh) {
         if (session.is_login) ssh_disconnect(session.ssh);
         ssh_free(session.ssh);
@@ -69,21 +347,182 @@ void clear_login(SFTPSession& session)
     session.is_login = false;
 }
 
-bool session_init(SFTPSession& session, Responser response, int cmd, int id)
+const Clock::time_point process_start = Clock::now();
+
+void quiet_response(int, int, int, const std::string&) {}
+
+// idle connections kept per key (a full set of lanes between two batches), and how long they may stay idle
+#define POOL_MAX_IDLE 32
+#define POOL_IDLE_SEC 300
+
+/** authenticated ssh connections of closed sessions, spare lanes after a batch and --warm, keyed by host/port/user/password as requested
+ * new sessions and lanes to the same key take one and only open a new sftp channel on it
+ * a connection belongs to one session at a time, libssh sessions are not thread safe
+ */
+class ConnPool
+{
+  public:
+    ssh_session take(const std::string& key)
+    {
+        std::vector<ssh_session> stale;
+        ssh_session ssh = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = idle.find(key);
+            if (it == idle.end()) { return nullptr; }
+            auto& conns = it->second;
+            while (!conns.empty() && !ssh) {
+                auto conn = conns.back();
+                conns.pop_back();
+                if (Clock::now() - conn.since > std::chrono::seconds(POOL_IDLE_SEC) || !ssh_is_connected(conn.ssh)) {
+                    stale.push_back(conn.ssh);
+                } else {
+                    ssh = conn.ssh;
+                }
+            }
+            if (conns.empty()) { idle.erase(it); }
+        }
+        for (auto* dead : stale) {
+            ssh_disconnect(dead);
+            ssh_free(dead);
+        }
+        return ssh;
+    }
+
+    // false when the key already has enough idle connections, the caller keeps ssh
+    bool put(const std::string& key, ssh_session ssh)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto& conns = idle[key];
+        if (conns.size() >= POOL_MAX_IDLE) { return false; }
+        conns.push_back({ssh, Clock::now()});
+        return true;
+    }
+
+  private:
+    struct Idle
+    {
+        ssh_session ssh;
+        Clock::time_point since;
+    };
+    std::mutex mutex;
+    std::unordered_map<std::string, std::vector<Idle>> idle;
+};
+
+ConnPool conn_pool;
+
+std::string pool_key(const std::string& hostname, unsigned int port, const std::string& uname, const std::string& password)
+{
+    return fmt::format("{}@{}:{}\n{}", uname, hostname, port, password);
+}
+
+// zlib level picked by "compression=auto", low enough to keep up with a fast link
+#define AUTO_COMPRESSION_LEVEL 3
+
+bool cpu_has_aes()
+{
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+    return __builtin_cpu_supports("aes");
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRYPTO)
+    return true;
+#else
+    return false;
+#endif
+}
+
+// "ciphers=fast": AEAD ciphers, AES-GCM first when the cpu has AES instructions, chacha20 otherwise
+std::string fast_ciphers()
+{
+    return cpu_has_aes() ? "aes128-gcm@openssh.com,aes256-gcm@openssh.com,chacha20-poly1305@openssh.com,aes128-ctr"
+                         : "chacha20-poly1305@openssh.com,aes128-gcm@openssh.com,aes256-gcm@openssh.com,aes128-ctr";
+}
+
+// the AEAD ciphers bring their own integrity, these only matter for the ctr fallback
+#define FAST_MACS "hmac-sha2-256-etm@openssh.com,umac-128-etm@openssh.com,hmac-sha2-256"
+
+std::string session_option(const SFTPSession& session, const char* key)
+{
+    auto it = session.options.find(key);
+    return it == session.options.end() ? "" : it->second;
+}
+
+// "compression" option: "auto" starts off until plan_compression samples a batch
+int compression_level(const Options& options)
+{
+    auto it = options.find("compression");
+    if (it == options.end()) { return -1; }
+    auto& value = it->second;
+    if (value == "auto" || value == "no" || value == "0") { return 0; }
+    if (value == "yes") { return 6; }
+    return std::clamp(std::atoi(value.c_str()), 0, 9);
+}
+
+// connections only stand in for each other with the same transport settings
+std::string conn_key(const SFTPSession& session)
+{
+    return fmt::format("{}\n{}\n{}\n{}\n{}", session.pool_key, session.compress, session_option(session, "ciphers"), session_option(session, "macs"),
+                       session_option(session, "identity"));
+}
+
+// before ssh_connect, the choices go into the key exchange
+void apply_transport_options(SFTPSession& session, Responser response, int cmd, int id)
+{
+    if (session.compress >= 0) {
+        ssh_options_set(session.ssh, SSH_OPTIONS_COMPRESSION, session.compress > 0 ? "yes" : "no");
+        if (session.compress > 0) ssh_options_set(session.ssh, SSH_OPTIONS_COMPRESSION_LEVEL, &session.compress);
+    }
+
+    auto ciphers = session_option(session, "ciphers");
+    auto macs = session_option(session, "macs");
+    if (ciphers == "fast") {
+        ciphers = fast_ciphers();
+        if (macs.empty()) macs = FAST_MACS;
+    }
+    if (macs == "fast") macs = FAST_MACS;
+    if (!ciphers.empty() && (ssh_options_set(session.ssh, SSH_OPTIONS_CIPHERS_C_S, ciphers.c_str()) != SSH_OK ||
+                             ssh_options_set(session.ssh, SSH_OPTIONS_CIPHERS_S_C, ciphers.c_str()) != SSH_OK)) {
+        response(cmd, id, RES_INFO, fmt::format("ciphers not supported, keep defaults: {}", ciphers));
+    }
+    if (!macs.empty() && (ssh_options_set(session.ssh, SSH_OPTIONS_HMAC_C_S, macs.c_str()) != SSH_OK ||
+                          ssh_options_set(session.ssh, SSH_OPTIONS_HMAC_S_C, macs.c_str()) != SSH_OK)) {
+        response(cmd, id, RES_INFO, fmt::format("macs not supported, keep defaults: {}", macs));
+    }
+}
+
+// hand a working connection back to the pool, anything else is closed
+void release_login(SFTPSession& session)
 {
+    if (session.sftp) {
+        sftp_free(session.sftp);
+        session.sftp = nullptr;
+    }
+    if (session.ssh && session.is_login && !session.pool_key.empty() && ssh_is_connected(session.ssh) && conn_pool.put(conn_key(session), session.ssh)) {
+        session.ssh = nullptr;
+        session.is_login = false;
+    }
+    clear_login(session);
+}
 
+// ssh connect and authentication, no sftp channel yet
+bool ssh_login(SFTPSession& session, Responser response, int cmd, int id)
+{
     clear_login(session);
     session.ssh = ssh_new();
 
     ssh_options_parse_config(session.ssh, nullptr);
 
     ssh_options_set(session.ssh, SSH_OPTIONS_HOST, session.hostname.c_str());
-    ssh_options_set(session.ssh, SSH_OPTIONS_USER, session.uname.c_str());
+    if (!session.uname.empty()) ssh_options_set(session.ssh, SSH_OPTIONS_USER, session.uname.c_str());
+    // the port has to be set before connecting, 0 keeps the one from the ssh config
+    if (session.port) ssh_options_set(session.ssh, SSH_OPTIONS_PORT, &session.port);
+    auto identity = session_option(session, "identity");
+    if (!identity.empty()) ssh_options_set(session.ssh, SSH_OPTIONS_ADD_IDENTITY, identity.c_str());
 
     auto ERRSTATUS = RES_ERROR;
 
-    int timeout = 10;
+    long timeout = SSH_TIMEOUT_SEC;
     ssh_options_set(session.ssh, SSH_OPTIONS_TIMEOUT, &timeout);
+    apply_transport_options(session, response, cmd, id);
 
     if (ssh_connect(session.ssh) != SSH_OK) {
         response(cmd, id, ERRSTATUS, //
@@ -92,43 +531,42 @@ bool session_init(SFTPSession& session, Responser response, int cmd, int id)
         return false;
     }
 
-    if (session.password.empty()) {
-        if (session.uname.empty()) {
-            char* uname_cstr = nullptr;
-            ssh_options_get(session.ssh, SSH_OPTIONS_USER, &uname_cstr);
+    if (session.uname.empty()) {
+        char* uname_cstr = nullptr;
+        if (ssh_options_get(session.ssh, SSH_OPTIONS_USER, &uname_cstr) == SSH_OK && uname_cstr) {
             session.uname = uname_cstr;
-        } else {
-            ssh_options_set(session.ssh, SSH_OPTIONS_USER, session.uname.c_str());
-        }
-
-        if (session.port) {
-            ssh_options_set(session.ssh, SSH_OPTIONS_PORT, &session.port);
-        } else {
-            ssh_options_get_port(session.ssh, &session.port);
+            ssh_string_free_char(uname_cstr);
         }
+    }
+    if (!session.port) ssh_options_get_port(session.ssh, &session.port);
 
-        if (ssh_userauth_publickey_auto(session.ssh, nullptr, nullptr) != SSH_AUTH_SUCCESS) {
-            response(cmd, id, ERRSTATUS, //
-                     fmt::format("SSH authentication failed. host({}:{}) username({}), {}", session.hostname, session.port, session.uname,
-                                 ssh_get_error(session.ssh)));
-            clear_login(session);
-            return false;
-        }
-    } else {
-        if (session.port) { ssh_options_set(session.ssh, SSH_OPTIONS_PORT, &session.port); }
-        if (ssh_userauth_password(session.ssh, session.uname.c_str(), session.password.c_str()) != SSH_AUTH_SUCCESS) {
-            response(cmd, id, ERRSTATUS, //
-                     fmt::format("SSH authentication failed. host({}:{}) username({}), {}", session.hostname, session.port, session.uname,
-                                 ssh_get_error(session.ssh)));
-            clear_login(session);
-            return false;
-        }
+    int auth = session.password.empty() ? ssh_userauth_publickey_auto(session.ssh, nullptr, nullptr)
+                                        : ssh_userauth_password(session.ssh, session.uname.c_str(), session.password.c_str());
+    if (auth != SSH_AUTH_SUCCESS) {
+        response(cmd, id, ERRSTATUS, //
+                 fmt::format("SSH authentication failed. host({}:{}) username({}), {}", session.hostname, session.port, session.uname,
+                             ssh_get_error(session.ssh)));
+        clear_login(session);
+        return false;
     }
+    session.is_login = true;
 
     auto str = fmt::format("SSH login success. host({}:{}) username({})", session.hostname, session.port, session.uname);
     response(cmd, id, RES_INFO, str);
 
     response(cmd, id, RES_INFO, fmt::format("SSH authentication success. host({}:{}) username({})", session.hostname, session.port, session.uname));
+    if (session.compress >= 0 || session.options.count("ciphers") || session.options.count("macs")) {
+        auto* cipher = ssh_get_cipher_out(session.ssh);
+        auto* mac = ssh_get_hmac_out(session.ssh);
+        response(cmd, id, RES_INFO,
+                 fmt::format("SSH transport cipher({}) mac({}) compression({})", cipher ? cipher : "?", mac ? mac : "?", std::max(session.compress, 0)));
+    }
+    return true;
+}
+
+bool sftp_open_channel(SFTPSession& session, Responser response, int cmd, int id)
+{
+    auto ERRSTATUS = RES_ERROR;
 
     // Create SFTP session
     session.sftp = sftp_new(session.ssh);
@@ -136,7 +574,6 @@ bool session_init(SFTPSession& session, Responser response, int cmd, int id)
     if (session.sftp == nullptr) {
         response(cmd, id, ERRSTATUS,
                  fmt::format("SFTP create failed. host({}:{}) username({}), {}", session.hostname, session.port, session.uname, ssh_get_error(session.ssh)));
-        clear_login(session);
         return false;
     }
 
@@ -145,26 +582,109 @@ bool session_init(SFTPSession& session, Responser response, int cmd, int id)
             fmt::format("SFTP init failed. host({}:{}) username({}), err: {}", session.hostname, session.port, session.uname, sftp_get_error(session.sftp));
         response(cmd, id, ERRSTATUS, msg);
         sftp_free(session.sftp);
-        clear_login(session);
+        session.sftp = nullptr;
         return false;
     }
 
+    session.max_write = SFTP_MIN_IO_LENGTH;
+    session.max_read = SFTP_MIN_IO_LENGTH;
+#if SFTP_PIP_AIO
+    if (auto limits = sftp_limits(session.sftp)) {
+        if (limits->max_write_length) session.max_write = limits->max_write_length;
+        if (limits->max_read_length) session.max_read = limits->max_read_length;
+        sftp_limits_free(limits);
+    }
+#endif
+    return true;
+}
+
+/** connect, authenticate and open the sftp channel
+ * a pooled connection for the session's pool_key skips connect and authentication
+ * reused: set when a pooled connection was taken
+ */
+bool session_init(SFTPSession& session, Responser response, int cmd, int id, bool* reused = nullptr)
+{
+    clear_login(session);
+    if (reused) *reused = false;
+
+    if (!session.pool_key.empty()) {
+        // a pooled connection can have died while idle, fall back to a fresh one
+        auto key = conn_key(session);
+        while (auto* ssh = conn_pool.take(key)) {
+            session.ssh = ssh;
+            session.is_login = true;
+            if (sftp_open_channel(session, quiet_response, cmd, id)) {
+                response(cmd, id, RES_INFO, fmt::format("SSH connection reused. host({}:{}) username({})", session.hostname, session.port, session.uname));
+                if (reused) *reused = true;
+                return true;
+            }
+            clear_login(session);
+        }
+    }
+
+    if (!ssh_login(session, response, cmd, id)) { return false; }
+    if (!sftp_open_channel(session, response, cmd, id)) {
+        clear_login(session);
+        return false;
+    }
     return true;
 }
 
+void warm_connection(const std::string& spec, Responser response)
+{
+    // [user@]host[:port], written the way new_session gets them so the keys match
+    SFTPSession session;
+    session.ssh = nullptr;
+    session.sftp = nullptr;
+    session.is_login = false;
+    session.port = 0;
+    auto at = spec.find('@');
+    session.uname = at == std::string::npos ? "" : spec.substr(0, at);
+    session.hostname = at == std::string::npos ? spec : spec.substr(at + 1);
+    auto colon = session.hostname.find(':');
+    if (colon != std::string::npos) {
+        session.port = (unsigned int)std::atoi(session.hostname.c_str() + colon + 1);
+        session.hostname.erase(colon);
+    }
+    session.pool_key = pool_key(session.hostname, session.port, session.uname, "");
+    auto key = conn_key(session);
+
+    auto start = Clock::now();
+    if (!ssh_login(session, quiet_response, CMD_READY, 0)) {
+        response(CMD_READY, 0, RES_INFO, fmt::format("warm connection failed: {}", spec));
+        return;
+    }
+    if (!conn_pool.put(key, session.ssh)) {
+        clear_login(session);
+        return;
+    }
+    response(CMD_READY, 0, RES_INFO, fmt::format("warm connection ready: {} ({:.3f} ms)", spec, elapsed_us(start) / 1e3));
+}
+
 void get_req_head(std::string_view msg, ReqHead& head)
 {
-    std::istringstream iss(msg.data());
+    std::istringstream iss{std::string(msg)};
     iss >> head.cmd >> head.id >> head.sessionId;
-    if (sftp_sessions.count(head.sessionId)) {
-        head.session = &sftp_sessions[head.sessionId];
+    head.session = find_session(head.sessionId);
+    std::string token;
+    while (iss >> token) { parse_option(token, head.options); }
+}
+
+void parse_option(std::string_view token, Options& options)
+{
+    if (token.empty()) { return; }
+    auto eq = token.find('=');
+    if (eq == std::string_view::npos) {
+        options[std::string(token)] = "1";
     } else {
-        head.session = nullptr;
+        options[std::string(token.substr(0, eq))] = std::string(token.substr(eq + 1));
     }
-    iss.eof();
 }
 
-void new_session(const ReqHead& head, std::vector<std::string>& msgs, Responser response)
+void start_health();
+long long keepalive_us(const SFTPSession& session);
+
+void new_session(const ReqHead& head, Msgs& msgs, Responser response)
 {
     auto id = head.id;
 
@@ -172,6 +692,9 @@ void new_session(const ReqHead& head, std::vector<std::string>& msgs, Responser
     session.ssh = nullptr;
     session.sftp = nullptr;
     session.is_login = false;
+    session.max_write = SFTP_MIN_IO_LENGTH;
+    session.max_read = SFTP_MIN_IO_LENGTH;
+    session.dirs = std::make_shared<DirCache>();
 
     session.hostname = msgs[1];
     session.uname = msgs[2];
@@ -181,14 +704,39 @@ void new_session(const ReqHead& head, std::vector<std::string>& msgs, Responser
     if (msgs[4] == "")
         session.port = 0;
     else
-        session.port = std::stoi(msgs[4]);
+        session.port = std::stoi(std::string(msgs[4]));
+
+    for (size_t i = 5; i < msgs.size(); ++i) { parse_option(msgs[i], session.options); }
+
+    session.pool_key = pool_key(session.hostname, session.port, session.uname, session.password);
+    session.compress = compression_level(session.options);
+    if (auto rate = parse_bytes(session_option(session, "rate"))) session.rate = std::make_shared<TokenBucket>(rate);
+    session.requested = Clock::now() - std::chrono::microseconds(head.queued_us);
+    session.first_byte = std::make_shared<std::atomic<bool>>(false);
+    session.stats = std::make_shared<TransferStats>();
+    session.progress = session.stats->add_lane();
+    session.stripes = std::make_shared<StripeSet>();
+    if (keepalive_us(session) > 0) start_health();
+
+    auto connect_start = Clock::now();
+    bool reused = false;
+    bool connected = session_init(session, response, CMD_NEW_SESSION, id, &reused);
+    if (head.options.count("metrics") || session.options.count("metrics")) {
+        response(CMD_NEW_SESSION, id, RES_INFO,
+                 fmt::format("metrics queue_ms({:.3f}) connect_ms({:.3f}) reused({}) startup_ms({:.3f})", head.queued_us / 1e3,
+                             elapsed_us(connect_start) / 1e3, reused ? 1 : 0, elapsed_us(process_start) / 1e3));
+    }
 
-    if (!session_init(session, response, CMD_NEW_SESSION, id)) {
+    if (!connected) {
         response(CMD_NEW_SESSION, id, RES_ERROR_DONE, "Failed to initialize SFTP session");
     } else {
-        sftp_sessions[session_count] = session;
-        response(CMD_NEW_SESSION, id, RES_DONE, fmt::format("{}\ncreate new session successfully -> {}", session_count, session.hostname));
-        session_count++;
+        int sessionId;
+        {
+            std::lock_guard<std::mutex> lock(sftp_sessions_mutex);
+            sessionId = session_count++;
+            sftp_sessions[sessionId] = session;
+        }
+        response(CMD_NEW_SESSION, id, RES_DONE, fmt::format("{}\ncreate new session successfully -> {}", sessionId, session.hostname));
     }
 }
 
@@ -200,6 +748,20 @@ namespace fs = std::filesystem;
 #define S_IRWXU 0700
 #endif
 
+/** request timing, enabled by the "metrics" option
+ * times are summed over all files and lanes of a request
+ */
+struct Metrics
+{
+    long long queue_us = 0;
+    std::atomic<long long> connect_us{0};
+    std::atomic<long long> open_us{0};
+    std::atomic<long long> transfer_us{0};
+    std::atomic<long long> close_us{0};
+    std::atomic<int> files{0};
+    Clock::time_point start = Clock::now();
+};
+
 struct ActionArgs
 {
     int id;
@@ -210,227 +772,3704 @@ struct ActionArgs
     std::string_view path;
     Responser response;
     int err;
+    const Options* options; // request options, fall back to session options
+    Metrics* metrics;       // null unless requested
+    const struct SkipPlan* skip; // null unless "skip" is requested, see plan_skip
+    bool skipped;                // set by the transfer when the file was left alone
 };
 
+void add_metric(std::atomic<long long> Metrics::*field, const ActionArgs& action, Clock::time_point since)
+{
+    if (action.metrics) { (action.metrics->*field) += elapsed_us(since); }
+}
+
+void report_metrics(const ActionArgs& action)
+{
+    auto* m = action.metrics;
+    if (!m) { return; }
+    int files = m->files;
+    action.response(action.cmd, action.id, RES_INFO,
+                    fmt::format("metrics queue_ms({:.3f}) connect_ms({:.3f}) open_ms({:.3f}) transfer_ms({:.3f}) close_ms({:.3f}) files({}) "
+                                "open_avg_ms({:.3f}) total_ms({:.3f})",
+                                m->queue_us / 1e3, m->connect_us / 1e3, m->open_us / 1e3, m->transfer_us / 1e3, m->close_us / 1e3, files,
+                                files ? m->open_us / 1e3 / files : 0.0, elapsed_us(m->start) / 1e3));
+}
+
 int check_reconnect_action(ActionArgs& action);
 
-std::string ensure_remote_dir(sftp_session sftp, const std::string& remote_path);
-std::string sftp_error_str(int code);
+// once per session, the first file data about to go over the wire
+void note_first_byte(const ActionArgs& action)
+{
+    auto& flag = action.session->first_byte;
+    if (!action.metrics || !flag || flag->exchange(true)) { return; }
+    action.response(action.cmd, action.id, RES_INFO,
+                    fmt::format("metrics first_byte_ms({:.3f}) startup_first_byte_ms({:.3f})", elapsed_us(action.session->requested) / 1e3,
+                                elapsed_us(process_start) / 1e3));
+}
 
-Err upload_one_file(ActionArgs& action)
+std::string option_str(const ActionArgs& action, const char* key, const std::string& def)
 {
-    auto& session = *action.session;
-    int id = action.id;
-    auto localRoot = action.localRoot;
-    auto remoteRoot = action.remoteRoot;
-    auto path = action.path;
-    auto response = action.response;
+    if (action.options) {
+        auto it = action.options->find(key);
+        if (it != action.options->end()) return it->second;
+    }
+    auto it = action.session->options.find(key);
+    if (it != action.session->options.end()) return it->second;
+    return def;
+}
 
-    std::string abs_local = fs::absolute(fs::path(localRoot) / path).string();
-    std::string abs_remote = (fs::path(remoteRoot) / path).generic_string();
+long long option_int(const ActionArgs& action, const char* key, long long def)
+{
+    auto value = option_str(action, key, "");
+    if (value.empty()) { return def; }
+    try {
+        return std::stoll(value);
+    } catch (...) {
+        return def;
+    }
+}
 
-    std::ifstream file(abs_local, std::ios::binary);
+std::string to_hex(const unsigned char* data, size_t len)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(len * 2, '0');
+    for (size_t i = 0; i < len; ++i) {
+        hex[i * 2] = digits[data[i] >> 4];
+        hex[i * 2 + 1] = digits[data[i] & 0xf];
+    }
+    return hex;
+}
 
-    if (!file) {
-        response(                       //
-            CMD_UPLOADS, id, RES_ERROR, //
-            fmt::format("Local file open failed | not found: {}", abs_local));
-        return Err::error(1);
+#define HASH_QUEUE_MAX 64
+#define VERIFY_THREAD_MIN (1024 * 1024)
+
+/** sha256 over the bytes of one transfer, fed in file order while the chunks go out or come in
+ * threaded: a worker digests the chunks, the transfer loop only queues them (at most HASH_QUEUE_MAX),
+ * stable chunks (mapped source) are queued by pointer, the others are copied
+ */
+struct StreamHasher
+{
+    explicit StreamHasher(bool threaded) : ctx(EVP_MD_CTX_new())
+    {
+        EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr);
+        if (threaded) worker = std::thread([this] { run(); });
+    }
+    ~StreamHasher()
+    {
+        finish();
+        EVP_MD_CTX_free(ctx);
     }
+    StreamHasher(const StreamHasher&) = delete;
+    StreamHasher& operator=(const StreamHasher&) = delete;
 
-    // local file exists
-    sftp_file remote_file = sftp_open(session.sftp, abs_remote.data(), O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
+    // stable: data stays valid until finish()
+    void feed(const char* data, size_t len, bool stable)
+    {
+        if (!worker.joinable()) {
+            EVP_DigestUpdate(ctx, data, len);
+            return;
+        }
+        Chunk chunk{data, len, {}};
+        std::unique_lock<std::mutex> guard(lock);
+        cond.wait(guard, [this] { return queue.size() < HASH_QUEUE_MAX; });
+        if (!stable) {
+            if (!spare.empty()) {
+                chunk.copy = std::move(spare.back());
+                spare.pop_back();
+            }
+            chunk.copy.assign(data, data + len);
+            chunk.data = chunk.copy.data();
+        }
+        queue.push_back(std::move(chunk));
+        cond.notify_all();
+    }
 
-    if (!remote_file) {
+    // lowercase hex of everything fed, waits for the queued chunks
+    std::string finish()
+    {
+        if (!digest.empty()) { return digest; }
+        if (worker.joinable()) {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                closing = true;
+            }
+            cond.notify_all();
+            worker.join();
+        }
+        unsigned char md[EVP_MAX_MD_SIZE];
+        unsigned int len = 0;
+        EVP_DigestFinal_ex(ctx, md, &len);
+        digest = to_hex(md, len);
+        return digest;
+    }
+
+  private:
+    struct Chunk
+    {
+        const char* data;
+        size_t len;
+        std::vector<char> copy;
+    };
+
+    void run()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        for (;;) {
+            cond.wait(guard, [this] { return closing || !queue.empty(); });
+            if (queue.empty()) { return; }
+            auto chunk = std::move(queue.front());
+            queue.pop_front();
+            cond.notify_all();
+            guard.unlock();
+            EVP_DigestUpdate(ctx, chunk.data, chunk.len);
+            guard.lock();
+            if (!chunk.copy.empty()) spare.push_back(std::move(chunk.copy));
+        }
+    }
+
+    EVP_MD_CTX* ctx;
+    std::thread worker;
+    std::mutex lock;
+    std::condition_variable cond;
+    std::deque<Chunk> queue;
+    std::vector<std::vector<char>> spare; // copy buffers handed back by the worker
+    bool closing = false;
+    std::string digest;
+};
+
+struct PipeParams
+{
+    size_t chunk;
+    int window;
+    LaneProgress* progress; // null when not tracked
+    TokenBucket* rate;      // session limit, null when unlimited
+    StreamHasher* hasher;   // "verify", null otherwise
+    uint64_t range;         // bytes to move from the start offset, 0 = to the end of the file (stripes)
+};
+
+// wait for n bytes of the session and the global limit, before the request goes out
+void throttle(const PipeParams& params, size_t n)
+{
+    if (params.rate) params.rate->take(n);
+    if (global_rate) global_rate->take(n);
+}
+
+// throttle for the event engine, which must not sleep: false while a limit is in debt, nothing is booked then
+bool throttle_ready(const PipeParams& params, size_t n)
+{
+    if (global_rate && !global_rate->ready()) { return false; }
+    if (params.rate && !params.rate->try_take(n)) { return false; }
+    if (global_rate) global_rate->try_take(n);
+    return true;
+}
+
+// request size is capped by what the server accepts, see session_init
+PipeParams pipe_params(const ActionArgs& action, uint64_t server_max)
+{
+    PipeParams params;
+    auto chunk = (uint64_t)std::max(option_int(action, "chunk", 256 * 1024), 1LL);
+    params.chunk = (size_t)std::max<uint64_t>(std::min(chunk, server_max), 1);
+    params.window = (int)std::clamp(option_int(action, "window", 16), 1LL, 256LL);
+    params.progress = action.session->progress.get();
+    params.rate = action.session->rate.get();
+    params.hasher = nullptr;
+    params.range = 0;
+#if !SFTP_PIP_AIO
+    params.window = 1;
+#endif
+    return params;
+}
+
+double mb_per_sec(uint64_t bytes, Clock::time_point start)
+{
+    auto sec = std::chrono::duration<double>(Clock::now() - start).count();
+    return sec > 0 ? bytes / (1024.0 * 1024.0) / sec : 0.0;
+}
+
+// write_remote_stream/read_remote_stream result for a failing local file, sftp codes are >= 0
+#define LOCAL_IO_ERROR -1
+
+/** keep up to params.window write requests in flight, from offset to the end of src
+ * mapped sources are handed to libssh without a copy
+ * return sftp error code, LOCAL_IO_ERROR, 0 on success
+ */
+int write_remote_stream(LocalSource& src, uint64_t offset, sftp_file remote_file, sftp_session sftp, const PipeParams& params, uint64_t& written)
+{
+    std::vector<char> buffer(params.chunk);
+    written = 0;
+    auto size = params.range ? std::min<uint64_t>(src.size(), offset + params.range) : src.size();
+
+    if (params.window <= 1) {
+        while (offset + written < size) {
+            auto n = (size_t)std::min<uint64_t>(params.chunk, size - offset - written);
+            auto data = src.view(offset + written, n, buffer.data());
+            if (!data) { return LOCAL_IO_ERROR; }
+            throttle(params, n);
+            if (params.hasher) params.hasher->feed(data, n, data != buffer.data());
+            if (sftp_write(remote_file, data, n) != (ssize_t)n) { return sftp_get_error(sftp); }
+            written += n;
+            if (params.progress) params.progress->advance(offset + written, n);
+        }
+        return 0;
+    }
+
+#if SFTP_PIP_AIO
+    // sftp_aio_begin_write sends the packet right away, so one buffer is enough
+    std::deque<std::pair<sftp_aio, ssize_t>> inflight;
+    auto drop_inflight = [&inflight] {
+        for (auto& req : inflight) sftp_aio_free(req.first);
+        inflight.clear();
+    };
+
+    uint64_t sent = 0;
+    while (offset + sent < size || !inflight.empty()) {
+        while (offset + sent < size && (int)inflight.size() < params.window) {
+            auto n = (size_t)std::min<uint64_t>(params.chunk, size - offset - sent);
+            auto data = src.view(offset + sent, n, buffer.data());
+            if (!data) {
+                drop_inflight();
+                return LOCAL_IO_ERROR;
+            }
+            throttle(params, n);
+            if (params.hasher) params.hasher->feed(data, n, data != buffer.data());
+            sftp_aio aio = nullptr;
+            if (sftp_aio_begin_write(remote_file, data, n, &aio) != (ssize_t)n) {
+                drop_inflight();
+                return sftp_get_error(sftp);
+            }
+            inflight.emplace_back(aio, n);
+            sent += n;
+        }
+
+        auto req = inflight.front();
+        inflight.pop_front();
+        if (sftp_aio_wait_write(&req.first) != req.second) {
+            drop_inflight();
+            return sftp_get_error(sftp);
+        }
+        written += req.second;
+        if (params.progress) params.progress->advance(offset + written, req.second);
+    }
+#endif
+    return 0;
+}
+
+std::string ensure_remote_dir(sftp_session sftp, const std::string& remote_path, DirCache* dirs);
+std::string ensure_remote_tree(sftp_session sftp, std::string subdir, DirCache* dirs);
+void plan_remote_dirs(ActionArgs& action, const Msgs& msgs, size_t first);
+std::string sftp_error_str(int code);
+
+// synchronous reads from the current offset until EOF, or params.range
+int read_remote_tail(sftp_file remote_file, LocalSink& sink, uint64_t offset, sftp_session sftp, size_t chunk, const PipeParams& params,
+                     uint64_t& received)
+{
+    AlignedBuffer buffer(chunk);
+    ssize_t n = 0;
+    for (;;) {
+        auto len = buffer.size();
+        if (params.range) {
+            if (received >= params.range) { break; }
+            len = (size_t)std::min<uint64_t>(len, params.range - received);
+        }
+        throttle(params, len);
+        if ((n = sftp_read(remote_file, buffer.data(), len)) <= 0) { break; }
+        if (!sink.write_at(offset + received, buffer.data(), n)) { return LOCAL_IO_ERROR; }
+        if (params.hasher) params.hasher->feed(buffer.data(), n, false);
+        received += n;
+        if (params.progress) params.progress->advance(offset + received, n);
+    }
+    return n < 0 ? sftp_get_error(sftp) : 0;
+}
+
+/** keep up to params.window read requests in flight, written out in request order
+ * offset: where the remote file position already is
+ * size: bytes left up to the remote size from fstat, the read-ahead stops there
+ * a short read before size drops the window and finishes synchronously,
+ * a failing first request (server rejects the request size) restarts with minimal reads
+ * return sftp error code, 0 on success
+ */
+int read_remote_stream(sftp_file remote_file, LocalSink& sink, sftp_session sftp, const PipeParams& params, uint64_t offset, uint64_t size,
+                       uint64_t& received)
+{
+    received = 0;
+    if (params.window <= 1) { return read_remote_tail(remote_file, sink, offset, sftp, params.chunk, params, received); }
+
+#if SFTP_PIP_AIO
+    AlignedBuffer buffer(params.chunk);
+    std::deque<std::pair<sftp_aio, size_t>> inflight;
+    auto drop_inflight = [&inflight] {
+        for (auto& req : inflight) sftp_aio_free(req.first);
+        inflight.clear();
+    };
+
+    uint64_t requested = 0;
+    while (received < size) {
+        while (requested < size && (int)inflight.size() < params.window) {
+            auto len = (size_t)std::min<uint64_t>(params.chunk, size - requested);
+            throttle(params, len);
+            sftp_aio aio = nullptr;
+            if (sftp_aio_begin_read(remote_file, len, &aio) != (ssize_t)len) {
+                drop_inflight();
+                return sftp_get_error(sftp);
+            }
+            inflight.emplace_back(aio, len);
+            requested += len;
+        }
+
+        auto req = inflight.front();
+        inflight.pop_front();
+        auto n = sftp_aio_wait_read(&req.first, buffer.data(), buffer.size());
+        if (n < 0) {
+            drop_inflight();
+            if (received > 0) { return sftp_get_error(sftp); }
+            // large reads rejected, fall back to the plain read loop
+            if (sftp_seek64(remote_file, offset) != SSH_OK) { return sftp_get_error(sftp); }
+            return read_remote_tail(remote_file, sink, offset, sftp, SFTP_MIN_IO_LENGTH, params, received);
+        }
+        if (!sink.write_at(offset + received, buffer.data(), n)) {
+            drop_inflight();
+            return LOCAL_IO_ERROR;
+        }
+        if (params.hasher) params.hasher->feed(buffer.data(), n, false);
+        received += n;
+        if (params.progress) params.progress->advance(offset + received, n);
+        if (n == 0) { break; } // truncated while reading
+
+        if ((size_t)n < req.second) {
+            // server capped the read length, the queued offsets are off now
+            drop_inflight();
+            if (received >= size) { break; }
+            if (sftp_seek64(remote_file, offset + received) != SSH_OK) { return sftp_get_error(sftp); }
+            return read_remote_tail(remote_file, sink, offset, sftp, std::min<size_t>(n, params.chunk), params, received);
+        }
+    }
+    drop_inflight();
+#endif
+    return 0;
+}
+
+std::string shell_quote(std::string_view str)
+{
+    std::string quoted = "'";
+    for (auto ch : str) {
+        if (ch == '\'') {
+            quoted += "'\\''";
+        } else {
+            quoted += ch;
+        }
+    }
+    quoted += "'";
+    return quoted;
+}
+
+/** run a command over an exec channel of the session
+ * out: stdout, stderr is dropped
+ * return exit status, -1 when no channel could be run
+ */
+int exec_remote(ssh_session ssh, const std::string& command, std::string* out)
+{
+    ssh_channel channel = ssh_channel_new(ssh);
+    if (!channel) { return -1; }
+    if (ssh_channel_open_session(channel) != SSH_OK) {
+        ssh_channel_free(channel);
+        return -1;
+    }
+    if (ssh_channel_request_exec(channel, command.c_str()) != SSH_OK) {
+        ssh_channel_close(channel);
+        ssh_channel_free(channel);
+        return -1;
+    }
+
+    char buffer[16 * 1024];
+    int n;
+    while ((n = ssh_channel_read(channel, buffer, sizeof(buffer), 0)) > 0) {
+        if (out) out->append(buffer, n);
+    }
+    while (ssh_channel_read(channel, buffer, sizeof(buffer), 1) > 0) {}
+
+    ssh_channel_send_eof(channel);
+    int status = n < 0 ? -1 : ssh_channel_get_exit_status(channel);
+    ssh_channel_close(channel);
+    ssh_channel_free(channel);
+    return status;
+}
+
+// sha256 of a local file as lowercase hex, empty when unreadable
+std::string local_sha256(const std::string& abs_local)
+{
+    LocalSource src;
+    if (!src.open(abs_local)) { return ""; }
+    auto* ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr);
+    std::vector<char> buffer(256 * 1024);
+    bool ok = true;
+    for (uint64_t offset = 0; ok && offset < src.size(); offset += buffer.size()) {
+        auto n = (size_t)std::min<uint64_t>(buffer.size(), src.size() - offset);
+        auto data = src.view(offset, n, buffer.data());
+        ok = data != nullptr;
+        if (ok) EVP_DigestUpdate(ctx, data, n);
+    }
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    EVP_DigestFinal_ex(ctx, digest, &len);
+    EVP_MD_CTX_free(ctx);
+    return ok ? to_hex(digest, len) : "";
+}
+
+// sha256 of a remote file through sha256sum (shasum on BSD/macOS), empty when neither runs
+std::string remote_sha256(ssh_session ssh, const std::string& abs_remote)
+{
+    auto path = shell_quote(abs_remote);
+    auto command = fmt::format("sha256sum -b -- {0} 2>/dev/null || shasum -a 256 -b -- {0}", path);
+    std::string out;
+    if (exec_remote(ssh, command, &out) != 0 || out.size() < 64) { return ""; }
+    auto hash = out.substr(0, 64);
+    if (hash.find_first_not_of("0123456789abcdef") != std::string::npos) { return ""; }
+    return hash;
+}
+
+// "verify" option: a hasher for a file of size bytes, hashing on its own thread when the file is large
+std::unique_ptr<StreamHasher> verify_hasher(const ActionArgs& action, uint64_t size)
+{
+    if (!option_int(action, "verify", 0)) { return nullptr; }
+    return std::make_unique<StreamHasher>(size >= VERIFY_THREAD_MIN);
+}
+
+// resume: the first len bytes came from an earlier attempt, hash them from the local copy before the stream
+bool hash_prefix(StreamHasher& hasher, LocalSource& src, uint64_t len)
+{
+    std::vector<char> buffer(256 * 1024);
+    for (uint64_t offset = 0; offset < len; offset += buffer.size()) {
+        auto n = (size_t)std::min<uint64_t>(buffer.size(), len - offset);
+        auto data = src.view(offset, n, buffer.data());
+        if (!data) { return false; }
+        hasher.feed(data, n, data != buffer.data());
+    }
+    return true;
+}
+
+/** compare the streamed hash with the finished remote file
+ * a remote without sha256sum/shasum is reported and passes
+ * return false after a mismatch response
+ */
+bool verify_remote(ActionArgs& action, StreamHasher& hasher, const std::string& abs_remote)
+{
+    auto local = hasher.finish();
+    auto remote = remote_sha256(action.session->ssh, abs_remote);
+    if (remote.empty()) {
+        action.response(action.cmd, action.id, RES_INFO, fmt::format("verify: remote sha256sum unavailable, not verified {}", abs_remote));
+        return true;
+    }
+    if (remote == local) { return true; }
+    action.response(action.cmd, action.id, RES_ERROR,
+                    fmt::format("Verify failed: {}, sha256 local {} remote {}", abs_remote, local, remote));
+    return false;
+}
+
+enum
+{
+    SKIP_NONE = 0,
+    SKIP_MTIME = 1, // size and mtime equal, uploads copy the local mtime
+    SKIP_HASH = 2,  // sha256 equal, remote side via "sha256sum"
+};
+
+struct RemoteAttr
+{
+    uint64_t size;
+    uint64_t mtime;
+};
+
+/** what the batch knows about its remote targets before any lane starts
+ * the lanes only read it
+ */
+struct SkipPlan
+{
+    int mode = SKIP_NONE;
+    std::unordered_map<std::string, RemoteAttr> attrs; // abs remote path -> attributes from a listing
+    std::unordered_set<std::string> listed;            // fully listed dirs, a name missing there is a new file
+    std::unordered_set<std::string> same;              // abs remote paths with a matching hash
+};
+
+// a directory holding at least this many files of the batch is listed instead of stat'ed per file
+#define SKIP_LIST_MIN_FILES 4
+// paths per sha256sum exec, keeps the command line well below ARG_MAX
+#define SKIP_HASH_BATCH 200
+
+std::string remote_path_of(const ActionArgs& action, std::string_view path) { return (fs::path(action.remoteRoot) / path).generic_string(); }
+
+std::string local_path_of(const ActionArgs& action, std::string_view path) { return fs::absolute(fs::path(action.localRoot) / path).string(); }
+
+/** batch-stat the remote targets for "skip=mtime|hash"
+ * mtime: directories with many targets are read with one readdir, others are stat'ed per file by the lanes
+ * hash: remote hashes in batched sha256sum execs, local ones with openssl
+ */
+void plan_skip(ActionArgs& action, const Msgs& msgs, size_t first, SkipPlan& plan)
+{
+    auto& session = *action.session;
+    auto mode = option_str(action, "skip", "");
+    if (mode == "hash") {
+        plan.mode = SKIP_HASH;
+    } else if (mode == "mtime" || mode == "1") {
+        plan.mode = SKIP_MTIME;
+    } else {
+        return;
+    }
+
+    if (plan.mode == SKIP_HASH) {
+        for (size_t i = first; i < msgs.size(); i += SKIP_HASH_BATCH) {
+            auto end = std::min(msgs.size(), i + SKIP_HASH_BATCH);
+            std::string command = "sha256sum -b --";
+            for (auto j = i; j < end; ++j) command += " " + shell_quote(remote_path_of(action, msgs[j]));
+
+            // missing files only show up on stderr, a non-zero status is expected then
+            std::string out;
+            if (exec_remote(session.ssh, command, &out) < 0) {
+                action.response(action.cmd, action.id, RES_INFO, "skip=hash: remote sha256sum unavailable, uploading everything");
+                return;
+            }
+
+            std::unordered_map<std::string, std::string> remote;
+            std::istringstream lines(out);
+            std::string line;
+            while (std::getline(lines, line)) {
+                auto sep = line.find(" *");
+                if (sep == 64) remote[line.substr(sep + 2)] = line.substr(0, sep);
+            }
+            for (auto j = i; j < end; ++j) {
+                auto abs_remote = remote_path_of(action, msgs[j]);
+                auto it = remote.find(abs_remote);
+                if (it != remote.end() && it->second == local_sha256(local_path_of(action, msgs[j]))) plan.same.insert(abs_remote);
+            }
+        }
+        return;
+    }
+
+    std::unordered_map<std::string, int> per_dir;
+    for (size_t i = first; i < msgs.size(); ++i) {
+        auto abs_remote = remote_path_of(action, msgs[i]);
+        per_dir[abs_remote.substr(0, abs_remote.find_last_of('/'))]++;
+    }
+
+    for (auto& entry : per_dir) {
+        if (entry.second < SKIP_LIST_MIN_FILES) { continue; }
+        auto dir = sftp_opendir(session.sftp, entry.first.c_str());
+        if (!dir) { continue; } // missing dir: nothing to skip, the lanes find out on their own
+        sftp_attributes attrs;
+        while ((attrs = sftp_readdir(session.sftp, dir))) {
+            if (attrs->type == SSH_FILEXFER_TYPE_REGULAR && attrs->name) {
+                plan.attrs[entry.first + "/" + attrs->name] = RemoteAttr{attrs->size, attrs->mtime};
+            }
+            sftp_attributes_free(attrs);
+        }
+        if (sftp_dir_eof(dir)) plan.listed.insert(entry.first);
+        sftp_closedir(dir);
+    }
+}
+
+// "compression=auto" samples, a batch is compressible when its samples shrink to the good ratio,
+// compression stays on until a batch is worse than the bad ratio, batches in between keep the current setting
+#define COMPRESS_SAMPLE_FILES 8
+#define COMPRESS_SAMPLE_BYTES (64 * 1024)
+#define COMPRESS_GOOD_RATIO 0.6
+#define COMPRESS_BAD_RATIO 0.75
+
+// zlib level 1 on the head of a few files, compressed/raw, 1 when nothing could be read
+double sample_ratio(const std::vector<std::string>& files)
+{
+    uint64_t raw = 0, packed = 0;
+    std::vector<char> buffer(COMPRESS_SAMPLE_BYTES);
+    std::vector<Bytef> out(compressBound(COMPRESS_SAMPLE_BYTES));
+    for (auto& path : files) {
+        LocalSource src;
+        if (!src.open(path)) { continue; }
+        auto n = (size_t)std::min<uint64_t>(src.size(), COMPRESS_SAMPLE_BYTES);
+        auto data = n ? src.view(0, n, buffer.data()) : nullptr;
+        if (!data) { continue; }
+        uLongf len = out.size();
+        if (compress2(out.data(), &len, (const Bytef*)data, n, 1) != Z_OK) { continue; }
+        raw += n;
+        packed += len;
+    }
+    return raw ? (double)packed / raw : 1.0;
+}
+
+/** "compression=auto": decide from a sample of the batch's local files whether the link compresses,
+ * a change reconnects the session, lanes follow on their next connect
+ * files are sampled evenly over msgs[first..], or the first files under root when msgs is null
+ * false when the reconnect failed, the session has no connection then
+ */
+bool plan_compression(ActionArgs& action, const Msgs* msgs, size_t first)
+{
+    auto& session = *action.session;
+    if (option_str(action, "compression", "") != "auto") { return true; }
+
+    std::vector<std::string> files;
+    if (msgs) {
+        auto count = msgs->size() > first ? msgs->size() - first : 0;
+        auto step = std::max<size_t>(count / COMPRESS_SAMPLE_FILES, 1);
+        for (size_t i = first; i < msgs->size() && files.size() < COMPRESS_SAMPLE_FILES; i += step) files.push_back(local_path_of(action, (*msgs)[i]));
+    } else {
+        std::error_code ec;
+        for (auto it = fs::recursive_directory_iterator(fs::path(action.localRoot), ec); !ec && it != fs::recursive_directory_iterator();
+             it.increment(ec)) {
+            if (it->is_regular_file(ec)) files.push_back(it->path().string());
+            if (files.size() >= COMPRESS_SAMPLE_FILES) { break; }
+        }
+    }
+
+    auto ratio = sample_ratio(files);
+    int level = ratio <= COMPRESS_GOOD_RATIO ? AUTO_COMPRESSION_LEVEL : ratio >= COMPRESS_BAD_RATIO ? 0 : session.compress;
+    if (level == session.compress) { return true; }
+
+    action.response(action.cmd, action.id, RES_INFO,
+                    fmt::format("compression auto: sample ratio({:.2f}) files({}) -> {}", ratio, files.size(), level ? "on" : "off"));
+    for (auto& lane : session.lanes) {
+        release_login(lane);
+        lane.compress = level;
+    }
+    release_login(session);
+    session.compress = level;
+    if (session.dirs) session.dirs->clear();
+    return session_init(session, action.response, action.cmd, action.id);
+}
+
+bool local_attr(const std::string& abs_local, RemoteAttr& attr)
+{
+    struct stat st;
+    if (stat(abs_local.c_str(), &st) != 0) { return false; }
+    attr.size = st.st_size;
+    attr.mtime = st.st_mtime;
+    return true;
+}
+
+bool is_unchanged(ActionArgs& action, const std::string& abs_local, const std::string& abs_remote)
+{
+    auto& plan = *action.skip;
+    if (plan.mode == SKIP_HASH) { return plan.same.count(abs_remote) > 0; }
+
+    RemoteAttr local;
+    if (!local_attr(abs_local, local)) { return false; }
+
+    RemoteAttr remote;
+    auto it = plan.attrs.find(abs_remote);
+    if (it != plan.attrs.end()) {
+        remote = it->second;
+    } else if (plan.listed.count(abs_remote.substr(0, abs_remote.find_last_of('/')))) {
+        return false; // not in its listed directory: new file
+    } else {
+        auto attrs = sftp_stat(action.session->sftp, abs_remote.c_str());
+        if (!attrs) { return false; }
+        remote = RemoteAttr{attrs->size, attrs->mtime};
+        sftp_attributes_free(attrs);
+    }
+    return remote.size == local.size && remote.mtime == local.mtime;
+}
+
+// give the remote copy the local mtime, the next "skip=mtime" compares against it
+void copy_mtime(ActionArgs& action, const std::string& abs_local, const std::string& abs_remote)
+{
+    struct stat st;
+    if (stat(abs_local.c_str(), &st) != 0) { return; }
+    struct timeval times[2];
+    times[0].tv_sec = st.st_atime;
+    times[0].tv_usec = 0;
+    times[1].tv_sec = st.st_mtime;
+    times[1].tv_usec = 0;
+    sftp_utimes(action.session->sftp, abs_remote.c_str(), times);
+}
+
+enum
+{
+    RESUME_NONE = 0,
+    RESUME_SIZE = 1,   // continue after the size already written
+    RESUME_VERIFY = 2, // compare the tail of the partial file first
+};
+
+// partial transfers live next to the target until they are complete
+#define PART_SUFFIX ".sftp_pip.part"
+// bytes compared before resuming with "resume=verify"
+#define RESUME_TAIL (64 * 1024)
+
+int resume_mode(const ActionArgs& action)
+{
+    auto mode = option_str(action, "resume", "");
+    if (mode == "verify") return RESUME_VERIFY;
+    if (mode.empty() || mode == "0") return RESUME_NONE;
+    return RESUME_SIZE;
+}
+
+// read exactly len bytes at offset of a remote file, false on error or short file
+bool remote_read_at(sftp_session sftp, const std::string& remote, uint64_t offset, char* buffer, size_t len)
+{
+    auto remote_file = sftp_open(sftp, remote.c_str(), O_RDONLY, 0);
+    if (!remote_file) { return false; }
+    bool ok = sftp_seek64(remote_file, offset) == SSH_OK;
+    size_t got = 0;
+    while (ok && got < len) {
+        auto n = sftp_read(remote_file, buffer + got, len - got);
+        if (n <= 0) ok = false;
+        got += n > 0 ? n : 0;
+    }
+    sftp_close(remote_file);
+    return ok;
+}
+
+bool local_read_at(LocalSource& src, uint64_t offset, char* buffer, size_t len)
+{
+    auto data = src.view(offset, len, buffer);
+    if (data && data != buffer) std::memcpy(buffer, data, len);
+    return data != nullptr;
+}
+
+/** bytes of the remote part file that can be kept
+ * 0 when there is none, it is longer than the source, or its tail differs (verify)
+ */
+uint64_t remote_resume_offset(ActionArgs& action, LocalSource& file, const std::string& part, bool verify)
+{
+    auto attrs = sftp_stat(action.session->sftp, part.c_str());
+    if (!attrs) { return 0; }
+    uint64_t offset = attrs->size;
+    sftp_attributes_free(attrs);
+
+    if (offset > file.size()) { return 0; }
+
+    if (verify && offset > 0) {
+        auto len = (size_t)std::min<uint64_t>(RESUME_TAIL, offset);
+        std::vector<char> remote(len), local(len);
+        if (!remote_read_at(action.session->sftp, part, offset - len, remote.data(), len) || !local_read_at(file, offset - len, local.data(), len) ||
+            remote != local) {
+            action.response(action.cmd, action.id, RES_INFO, fmt::format("Partial file differs, restart {}", part));
+            return 0;
+        }
+    }
+    return offset;
+}
+
+// same for a local part file against the remote source
+uint64_t local_resume_offset(ActionArgs& action, const std::string& abs_remote, const std::string& part, uint64_t size, bool verify)
+{
+    std::error_code ec;
+    uint64_t offset = fs::file_size(part, ec);
+    if (ec || offset > size) { return 0; }
+
+    if (verify && offset > 0) {
+        auto len = (size_t)std::min<uint64_t>(RESUME_TAIL, offset);
+        std::vector<char> remote(len), local(len);
+        LocalSource file;
+        if (!file.open(part) || !remote_read_at(action.session->sftp, abs_remote, offset - len, remote.data(), len) || !local_read_at(file, offset - len, local.data(), len) ||
+            remote != local) {
+            action.response(action.cmd, action.id, RES_INFO, fmt::format("Partial file differs, restart {}", part));
+            return 0;
+        }
+    }
+    return offset;
+}
+
+/** move a finished part file over the target
+ * libssh uses posix-rename@openssh.com when the server has it, others refuse to overwrite
+ * return sftp error code, 0 on success
+ */
+int remote_replace(sftp_session sftp, const std::string& from, const std::string& to)
+{
+    if (sftp_rename(sftp, from.c_str(), to.c_str()) == SSH_OK) { return 0; }
+    sftp_unlink(sftp, to.c_str());
+    if (sftp_rename(sftp, from.c_str(), to.c_str()) == SSH_OK) { return 0; }
+    return sftp_get_error(sftp);
+}
+
+// create or truncate a remote file for writing, its directory is made when missing
+sftp_file open_remote_truncate(SFTPSession& session, const std::string& abs_remote, int& errcode)
+{
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    sftp_file file = sftp_open(session.sftp, abs_remote.data(), flags, S_IRWXU);
+    if (!file && sftp_get_error(session.sftp) == SSH_FX_NO_SUCH_FILE) {
+        auto parent = abs_remote.substr(0, abs_remote.find_last_of('/'));
+        if (session.dirs) session.dirs->forget(parent);
+        if (ensure_remote_dir(session.sftp, abs_remote, session.dirs.get()) == "") file = sftp_open(session.sftp, abs_remote.data(), flags, S_IRWXU);
+    }
+    errcode = file ? 0 : sftp_get_error(session.sftp);
+    return file;
+}
+
+// an extra connection to the session's host, connected on first use, see run_batch and transfer_striped
+SFTPSession new_lane(const SFTPSession& session)
+{
+    SFTPSession lane;
+    lane.ssh = nullptr;
+    lane.sftp = nullptr;
+    lane.is_login = false;
+    lane.hostname = session.hostname;
+    lane.port = session.port;
+    lane.uname = session.uname;
+    lane.password = session.password;
+    lane.options = session.options;
+    lane.dirs = session.dirs;
+    lane.pool_key = session.pool_key;
+    lane.requested = session.requested;
+    lane.first_byte = session.first_byte;
+    lane.compress = session.compress;
+    lane.rate = session.rate;
+    lane.stats = session.stats;
+    lane.stripes = session.stripes;
+    if (session.stats) lane.progress = session.stats->add_lane();
+    lane.max_write = SFTP_MIN_IO_LENGTH;
+    lane.max_read = SFTP_MIN_IO_LENGTH;
+    return lane;
+}
+
+/** "stripe=K": files of "stripe_min" bytes or more (default 256M) are split into K byte ranges,
+ * moved at once over the session's connection and K-1 stripe connections with positioned
+ * sftp reads/writes and pwrite locally, into a part file renamed once the size checks out
+ * resume does not apply, verify hashes the local file afterwards
+ */
+#define STRIPE_MIN (256ull * 1024 * 1024)
+#define STRIPE_MAX 16
+#define STRIPE_ALIGN (1024 * 1024)
+
+// one range over one connection, return sftp error code, LOCAL_IO_ERROR, 0 on success
+int transfer_stripe(ActionArgs action, SFTPSession& conn, bool upload, const std::string& local, const std::string& remote, uint64_t begin,
+                    uint64_t end, uint64_t& moved)
+{
+    action.session = &conn;
+    auto params = pipe_params(action, upload ? conn.max_write : conn.max_read);
+    params.range = end - begin;
+    auto requests = (params.range + params.chunk - 1) / params.chunk;
+    params.window = (int)std::max<uint64_t>(std::min<uint64_t>(params.window, requests), 1);
+    params.progress = conn.progress.get();
+    if (params.progress) params.progress->at(begin, end);
+
+    moved = 0;
+    sftp_file remote_file = sftp_open(conn.sftp, remote.c_str(), upload ? O_WRONLY : O_RDONLY, 0);
+    if (!remote_file) { return sftp_get_error(conn.sftp); }
+    if (sftp_seek64(remote_file, begin) != SSH_OK) {
+        int errcode = sftp_get_error(conn.sftp);
+        sftp_close(remote_file);
+        return errcode;
+    }
+
+    int errcode;
+    if (upload) {
+        LocalSource src;
+        errcode = src.open(local) ? write_remote_stream(src, begin, remote_file, conn.sftp, params, moved) : LOCAL_IO_ERROR;
+    } else {
+        LocalSink sink;
+        errcode = sink.open(local, false) ? read_remote_stream(remote_file, sink, conn.sftp, params, begin, params.range, moved) : LOCAL_IO_ERROR;
+        sink.close(); // the request thread checks the total, a partial part file is removed there
+    }
+    if (sftp_close(remote_file) != SSH_OK && errcode == 0) errcode = sftp_get_error(conn.sftp);
+    if (params.progress) params.progress->end();
+    return errcode;
+}
+
+/** move one large file in stripes when the "stripe" option asks for it
+ * false: not striped (option off, file too small, another lane has the stripe connections, none connect),
+ * the caller goes on with a plain transfer
+ * result: outcome of the striped transfer, responses are sent
+ */
+bool transfer_striped(ActionArgs& action, bool upload, const std::string& abs_local, const std::string& abs_remote, uint64_t size, Err& result)
+{
+    auto& session = *action.session;
+    auto count = (size_t)std::clamp(option_int(action, "stripe", 0), 0LL, (long long)STRIPE_MAX);
+    auto min_size = parse_bytes(option_str(action, "stripe_min", ""));
+    if (count < 2 || size < (min_size ? min_size : STRIPE_MIN) || !session.stripes) { return false; }
+    std::unique_lock<std::mutex> busy(session.stripes->busy, std::try_to_lock);
+    if (!busy) { return false; }
+
+    // connect the missing stripe connections in parallel
+    auto& conns = session.stripes->conns;
+    while (conns.size() + 1 < count) conns.push_back(new_lane(session));
+    std::vector<char> connected(count - 1, 0);
+    {
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i + 1 < count; ++i) {
+            auto* conn = &conns[i];
+            threads.emplace_back([&action, conn, &connected, i] {
+                auto connect_start = Clock::now();
+                connected[i] = conn->ssh || session_init(*conn, quiet_response, action.cmd, action.id);
+                add_metric(&Metrics::connect_us, action, connect_start);
+            });
+        }
+        for (auto& thread : threads) thread.join();
+    }
+    std::vector<SFTPSession*> used{&session};
+    for (size_t i = 0; i + 1 < count; ++i) {
+        if (connected[i]) used.push_back(&conns[i]);
+    }
+    if (used.size() < 2) {
+        action.response(action.cmd, action.id, RES_INFO, "stripe connections failed, transfer without striping");
+        return false;
+    }
+
+    auto local_target = upload ? abs_local : abs_local + PART_SUFFIX;
+    auto remote_target = upload ? abs_remote + PART_SUFFIX : abs_remote;
+    int errcode = 0;
+    std::error_code ec;
+    if (upload) {
+        // ranges open the part file without O_TRUNC, so it is created empty up front
+        auto remote_file = open_remote_truncate(session, remote_target, errcode);
+        if (remote_file) sftp_close(remote_file);
+    } else {
+        fs::create_directories(fs::path(abs_local).parent_path(), ec);
+        LocalSink sink;
+        if (sink.open(local_target, true)) {
+            sink.preallocate(size);
+        } else {
+            errcode = LOCAL_IO_ERROR;
+        }
+    }
+
+    // equal ranges on STRIPE_ALIGN boundaries, the last one takes the rest
+    auto step = (size / used.size() + STRIPE_ALIGN - 1) / STRIPE_ALIGN * STRIPE_ALIGN;
+    std::vector<uint64_t> moved(used.size(), 0);
+    std::vector<int> errors(used.size(), 0);
+    auto start = Clock::now();
+    if (errcode == 0) {
+        note_first_byte(action);
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < used.size(); ++i) {
+            auto begin = std::min<uint64_t>(i * step, size);
+            auto end = i + 1 == used.size() ? size : std::min<uint64_t>(begin + step, size);
+            if (begin >= end) { continue; }
+            threads.emplace_back([&, i, begin, end] {
+                errors[i] = transfer_stripe(action, *used[i], upload, local_target, remote_target, begin, end, moved[i]);
+            });
+        }
+        for (auto& thread : threads) thread.join();
+        for (auto error : errors) {
+            if (error != 0) {
+                errcode = error;
+                break;
+            }
+        }
+    }
+    add_metric(&Metrics::transfer_us, action, start);
+
+    uint64_t total = 0;
+    for (auto n : moved) total += n;
+    auto label = upload ? "upload" : "download";
+    // ranges land out of order, a partial part file could look complete to a later resume
+    auto drop_part = [&] {
+        if (upload) {
+            if (session.sftp) sftp_unlink(session.sftp, remote_target.c_str());
+        } else {
+            fs::remove(local_target, ec);
+        }
+    };
+    if (errcode == LOCAL_IO_ERROR) {
+        action.response(action.cmd, action.id, RES_ERROR, fmt::format("Local file {} failed: {}", upload ? "read" : "write", local_target));
+        drop_part();
+        result = Err::error(-1);
+        return true;
+    }
+    if (errcode != 0) {
+        drop_part();
+        action.response(action.cmd, action.id, RES_ERROR,
+                        fmt::format("Striped {} error, remote: {}, err ({}) {}", label, abs_remote, errcode, sftp_error_str(errcode)));
+        result = Err::sftpError(errcode);
+        return true;
+    }
+
+    // every range arrived in full and the target has exactly the source size, then it replaces the old file
+    uint64_t target_size = 0;
+    if (upload) {
+        if (auto attrs = sftp_stat(session.sftp, remote_target.c_str())) {
+            target_size = attrs->size;
+            sftp_attributes_free(attrs);
+        }
+    } else {
+        target_size = fs::file_size(local_target, ec);
+        if (ec) target_size = 0;
+    }
+    if (total != size || target_size != size) {
+        action.response(action.cmd, action.id, RES_ERROR,
+                        fmt::format("Striped {} size mismatch: {}, expected {} moved {} target {}", label, abs_remote, size, total, target_size));
+        drop_part();
+        result = Err::error(-1);
+        return true;
+    }
+    if (upload) {
+        errcode = remote_replace(session.sftp, remote_target, abs_remote);
+    } else {
+        fs::rename(local_target, abs_local, ec);
+    }
+    if (errcode != 0 || ec) {
+        auto reason = errcode ? sftp_error_str(errcode) : ec.message();
+        action.response(action.cmd, action.id, RES_ERROR, fmt::format("Rename failed: {} -> {}, {}", upload ? remote_target : local_target,
+                                                                      upload ? abs_remote : abs_local, reason));
+        result = errcode ? Err::sftpError(errcode) : Err::error(-1);
+        return true;
+    }
+
+    if (option_int(action, "verify", 0)) {
+        auto local = local_sha256(abs_local);
+        auto remote = remote_sha256(session.ssh, abs_remote);
+        if (!remote.empty() && local != remote) {
+            action.response(action.cmd, action.id, RES_ERROR, fmt::format("Verify failed: {}, sha256 local {} remote {}", abs_remote, local, remote));
+            if (!upload) fs::remove(abs_local, ec);
+            result = Err::error(-1);
+            return true;
+        }
+    }
+
+    action.response(action.cmd, action.id, RES_INFO,
+                    fmt::format("File {}ed successfully {} -> {} ({} bytes, {} stripes, {:.2f} MB/s)", label, upload ? abs_local : abs_remote,
+                                upload ? abs_remote : abs_local, size, used.size(), mb_per_sec(total, start)));
+    if (action.metrics) action.metrics->files++;
+    result = Err::success();
+    return true;
+}
+
+/** "delta": an upload over an existing remote file of "delta_min" bytes or more (default 8M) only sends the blocks that changed
+ * block hashes (sha256 per "delta_block" bytes, default 128K) come from a remote python3 over an exec channel,
+ * without it the remote blocks are read over sftp and hashed here,
+ * the remote file is copied with "cp" into a temp file, the changed blocks are written over it, then it is renamed into place
+ * without a remote cp the file goes up in full, resume does not apply
+ */
+#define DELTA_MIN (8ull * 1024 * 1024)
+#define DELTA_BLOCK (128 * 1024)
+#define DELTA_SUFFIX ".sftp_pip.delta"
+
+// argv: path, block size, prints one sha256 per block
+const char* DELTA_HASH_SCRIPT = "import sys, hashlib\n"
+                                "f = open(sys.argv[1], 'rb')\n"
+                                "b = int(sys.argv[2])\n"
+                                "while True:\n"
+                                "    d = f.read(b)\n"
+                                "    if not d: break\n"
+                                "    print(hashlib.sha256(d).hexdigest())\n";
+
+std::string block_sha256(const char* data, size_t len)
+{
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int n = 0;
+    EVP_Digest(data, len, digest, &n, EVP_sha256(), nullptr);
+    return to_hex(digest, n);
+}
+
+bool local_block_hashes(LocalSource& src, size_t block, std::vector<std::string>& hashes)
+{
+    std::vector<char> buffer(block);
+    for (uint64_t offset = 0; offset < src.size(); offset += block) {
+        auto n = (size_t)std::min<uint64_t>(block, src.size() - offset);
+        auto data = src.view(offset, n, buffer.data());
+        if (!data) { return false; }
+        hashes.push_back(block_sha256(data, n));
+    }
+    return true;
+}
+
+// false when neither the remote helper nor the sftp reads produce a hash per block of size bytes
+bool remote_block_hashes(SFTPSession& session, const std::string& abs_remote, size_t block, uint64_t size, std::vector<std::string>& hashes)
+{
+    auto blocks = (size + block - 1) / block;
+    std::string out;
+    auto command = fmt::format("python3 -c {} {} {}", shell_quote(DELTA_HASH_SCRIPT), shell_quote(abs_remote), block);
+    if (exec_remote(session.ssh, command, &out) == 0) {
+        std::istringstream lines(out);
+        for (std::string line; std::getline(lines, line);) {
+            if (line.size() == 64) hashes.push_back(line);
+        }
+        if (hashes.size() == blocks) { return true; }
+        hashes.clear();
+    }
+
+    sftp_file remote_file = sftp_open(session.sftp, abs_remote.c_str(), O_RDONLY, 0);
+    if (!remote_file) { return false; }
+    AlignedBuffer buffer(block);
+    bool ok = true;
+    for (uint64_t offset = 0; ok && offset < size; offset += block) {
+        auto want = (size_t)std::min<uint64_t>(block, size - offset);
+        size_t got = 0;
+        while (got < want) {
+            auto n = sftp_read(remote_file, buffer.data() + got, std::min<size_t>(want - got, session.max_read));
+            if (n <= 0) { break; }
+            got += n;
+        }
+        ok = got == want;
+        if (ok) hashes.push_back(block_sha256(buffer.data(), got));
+    }
+    sftp_close(remote_file);
+    return ok;
+}
+
+/** upload only the changed blocks of a large file when the "delta" option asks for it
+ * false: not a delta upload (option off, small or new file, no hashes, no remote cp), the caller uploads in full
+ * result: outcome of the delta upload, responses are sent
+ */
+bool transfer_delta(ActionArgs& action, LocalSource& file, const std::string& abs_local, const std::string& abs_remote, Err& result)
+{
+    auto& session = *action.session;
+    if (!option_int(action, "delta", 0)) { return false; }
+    auto min_size = parse_bytes(option_str(action, "delta_min", ""));
+    if (file.size() < (min_size ? min_size : DELTA_MIN)) { return false; }
+    auto block_option = parse_bytes(option_str(action, "delta_block", ""));
+    auto block = block_option ? (size_t)std::clamp<uint64_t>(block_option, 4096, 64 * 1024 * 1024) : (size_t)DELTA_BLOCK;
+
+    uint64_t remote_size = 0;
+    if (auto attrs = sftp_stat(session.sftp, abs_remote.c_str())) {
+        bool regular = attrs->type == SSH_FILEXFER_TYPE_REGULAR && (attrs->flags & SSH_FILEXFER_ATTR_SIZE);
+        remote_size = attrs->size;
+        sftp_attributes_free(attrs);
+        if (!regular) { return false; }
+    } else {
+        return false;
+    }
+
+    auto start = Clock::now();
+    std::vector<std::string> remote, local;
+    if (!remote_block_hashes(session, abs_remote, block, remote_size, remote)) {
+        action.response(action.cmd, action.id, RES_INFO, fmt::format("delta: remote block hashes unavailable, uploading in full {}", abs_remote));
+        return false;
+    }
+    if (!local_block_hashes(file, block, local)) {
+        action.response(action.cmd, action.id, RES_ERROR, fmt::format("Local file read failed: {}", abs_local));
+        result = Err::error(1);
+        return true;
+    }
+
+    // changed blocks, neighbours merged into one range
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    size_t changed = 0;
+    for (size_t i = 0; i < local.size(); ++i) {
+        if (i < remote.size() && remote[i] == local[i]) { continue; }
+        changed++;
+        auto begin = (uint64_t)i * block;
+        auto end = std::min<uint64_t>(begin + block, file.size());
+        if (!ranges.empty() && ranges.back().second == begin) {
+            ranges.back().second = end;
+        } else {
+            ranges.emplace_back(begin, end);
+        }
+    }
+
+    if (ranges.empty() && remote_size == file.size()) {
+        action.response(action.cmd, action.id, RES_INFO, fmt::format("File delta unchanged {} -> {} (saved {} bytes)", abs_local, abs_remote, file.size()));
+        result = Err::success();
+        return true;
+    }
+
+    auto temp = abs_remote + DELTA_SUFFIX;
+    if (exec_remote(session.ssh, fmt::format("cp -p -- {} {}", shell_quote(abs_remote), shell_quote(temp)), nullptr) != 0) {
+        sftp_unlink(session.sftp, temp.c_str());
+        action.response(action.cmd, action.id, RES_INFO, fmt::format("delta: remote cp unavailable, uploading in full {}", abs_remote));
+        return false;
+    }
+
+    int errcode = 0;
+    uint64_t sent = 0;
+    sftp_file remote_file = sftp_open(session.sftp, temp.c_str(), O_WRONLY, 0);
+    if (!remote_file) errcode = sftp_get_error(session.sftp);
+    if (remote_file && remote_size > file.size()) {
+        sftp_attributes_struct attr{};
+        attr.flags = SSH_FILEXFER_ATTR_SIZE;
+        attr.size = file.size();
+        if (sftp_setstat(session.sftp, temp.c_str(), &attr) != SSH_OK) errcode = sftp_get_error(session.sftp);
+    }
+
+    auto params = pipe_params(action, session.max_write);
+    note_first_byte(action);
+    for (auto& range : ranges) {
+        if (errcode != 0) { break; }
+        if (sftp_seek64(remote_file, range.first) != SSH_OK) {
+            errcode = sftp_get_error(session.sftp);
+            break;
+        }
+        params.range = range.second - range.first;
+        auto requests = (params.range + params.chunk - 1) / params.chunk;
+        params.window = (int)std::max<uint64_t>(std::min<uint64_t>(params.window, requests), 1);
+        if (params.progress) params.progress->at(range.first, file.size());
+        uint64_t written = 0;
+        errcode = write_remote_stream(file, range.first, remote_file, session.sftp, params, written);
+        sent += written;
+    }
+    if (remote_file && sftp_close(remote_file) != SSH_OK && errcode == 0) errcode = sftp_get_error(session.sftp);
+    if (errcode == 0) errcode = remote_replace(session.sftp, temp, abs_remote);
+    add_metric(&Metrics::transfer_us, action, start);
+
+    if (errcode == LOCAL_IO_ERROR) {
+        sftp_unlink(session.sftp, temp.c_str());
+        action.response(action.cmd, action.id, RES_ERROR, fmt::format("Local file read failed: {}", abs_local));
+        result = Err::error(1);
+        return true;
+    }
+    if (errcode != 0) {
+        sftp_unlink(session.sftp, temp.c_str());
+        action.response(action.cmd, action.id, RES_ERROR,
+                        fmt::format("Delta upload error, remote: {}, err ({}) {}", abs_remote, errcode, sftp_error_str(errcode)));
+        result = Err::sftpError(errcode);
+        return true;
+    }
+
+    if (option_int(action, "verify", 0)) {
+        auto local_hash = local_sha256(abs_local);
+        auto remote_hash = remote_sha256(session.ssh, abs_remote);
+        if (!remote_hash.empty() && local_hash != remote_hash) {
+            action.response(action.cmd, action.id, RES_ERROR,
+                            fmt::format("Verify failed: {}, sha256 local {} remote {}", abs_remote, local_hash, remote_hash));
+            result = Err::error(-1);
+            return true;
+        }
+    }
+
+    action.response(action.cmd, action.id, RES_INFO,
+                    fmt::format("File delta uploaded {} -> {} ({} bytes, changed blocks {}/{}, sent {} bytes, saved {} bytes)", abs_local, abs_remote,
+                                file.size(), changed, local.size(), sent, file.size() - sent));
+    if (action.metrics) action.metrics->files++;
+    result = Err::success();
+    return true;
+}
+
+Err upload_one_file(ActionArgs& action)
+{
+    auto& session = *action.session;
+    int id = action.id;
+    auto localRoot = action.localRoot;
+    auto remoteRoot = action.remoteRoot;
+    auto path = action.path;
+    auto response = action.response;
+
+    std::string abs_local = fs::absolute(fs::path(localRoot) / path).string();
+    std::string abs_remote = (fs::path(remoteRoot) / path).generic_string();
+
+    LocalSource file;
+
+    if (!file.open(abs_local)) {
+        response(                       //
+            action.cmd, id, RES_ERROR, //
+            fmt::format("Local file open failed | not found: {}", abs_local));
+        return Err::error(1);
+    }
+
+    if (action.skip && is_unchanged(action, abs_local, abs_remote)) {
+        response(action.cmd, id, RES_INFO, fmt::format("File unchanged, skipped {} -> {}", path, abs_remote));
+        action.skipped = true;
+        return Err::success();
+    }
+
+    Err delta;
+    if (transfer_delta(action, file, abs_local, abs_remote, delta)) {
+        if (!delta && action.skip) copy_mtime(action, abs_local, abs_remote);
+        return delta;
+    }
+
+    Err striped;
+    if (transfer_striped(action, true, abs_local, abs_remote, file.size(), striped)) {
+        if (!striped && action.skip) copy_mtime(action, abs_local, abs_remote);
+        return striped;
+    }
+
+    // resume: write to the part file, continue after what an earlier attempt left there
+    auto resume = resume_mode(action);
+    auto target = resume ? abs_remote + PART_SUFFIX : abs_remote;
+    uint64_t offset = resume ? remote_resume_offset(action, file, target, resume == RESUME_VERIFY) : 0;
+    int flags = offset ? O_WRONLY | O_CREAT : O_WRONLY | O_CREAT | O_TRUNC;
+
+    // local file exists
+    auto open_start = Clock::now();
+    sftp_file remote_file = sftp_open(session.sftp, target.data(), flags, S_IRWXU);
+
+    if (!remote_file) {
         // remote file not exists or error
         int errcode = sftp_get_error(session.sftp);
-        if (errcode == SSH_FX_NO_SUCH_FILE) {
-            auto err = ensure_remote_dir(session.sftp, abs_remote);
-            if (err == "") {
-                remote_file = sftp_open(session.sftp, abs_remote.data(), O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
-                if (!remote_file) { errcode = sftp_get_error(session.sftp); }
+        if (errcode == SSH_FX_NO_SUCH_FILE) {
+            auto parent = abs_remote.substr(0, abs_remote.find_last_of('/'));
+            if (session.dirs) session.dirs->forget(parent);
+            auto err = ensure_remote_dir(session.sftp, abs_remote, session.dirs.get());
+            if (err == "") {
+                remote_file = sftp_open(session.sftp, target.data(), flags, S_IRWXU);
+                if (!remote_file) { errcode = sftp_get_error(session.sftp); }
+            } else {
+                response(                       //
+                    action.cmd, id, RES_ERROR, //
+                    fmt::format("ensure remote dir failed: {}", err));
+                return Err::sftpError(errcode);
+            }
+        }
+        if (!remote_file) {
+            response(                       //
+                action.cmd, id, RES_ERROR, //
+                fmt::format("Remote file open failed: {}, {}", abs_remote, sftp_error_str(errcode)));
+            return Err::sftpError(errcode);
+        }
+    }
+
+    add_metric(&Metrics::open_us, action, open_start);
+
+    if (offset && sftp_seek64(remote_file, offset) != SSH_OK) {
+        int errcode = sftp_get_error(session.sftp);
+        sftp_close(remote_file);
+        return Err::sftpError(errcode);
+    }
+    if (offset) response(action.cmd, id, RES_INFO, fmt::format("File upload resumed at {} bytes {}", offset, abs_remote));
+
+    auto params = pipe_params(action, session.max_write);
+    auto hasher = verify_hasher(action, file.size());
+    if (hasher && offset && !hash_prefix(*hasher, file, offset)) {
+        response(action.cmd, id, RES_ERROR, fmt::format("Local file read failed: {}", abs_local));
+        sftp_close(remote_file);
+        return Err::error(1);
+    }
+    params.hasher = hasher.get();
+    if (params.progress) params.progress->at(offset, file.size());
+    note_first_byte(action);
+    auto start = Clock::now();
+    uint64_t written = 0;
+    int errcode = write_remote_stream(file, offset, remote_file, session.sftp, params, written);
+    add_metric(&Metrics::transfer_us, action, start);
+    if (errcode == LOCAL_IO_ERROR) {
+        response(                      //
+            action.cmd, id, RES_ERROR, //
+            fmt::format("Local file read failed: {}", abs_local));
+        sftp_close(remote_file);
+        return Err::error(1);
+    }
+    if (errcode != 0) {
+        response(                       //
+            action.cmd, id, RES_ERROR, //
+            fmt::format("File upload error , remote: {}, err ({}) {}", abs_remote, errcode, sftp_error_str(errcode)));
+        sftp_close(remote_file);
+        return Err::sftpError(errcode);
+    }
+
+    auto close_start = Clock::now();
+    int closed = sftp_close(remote_file);
+    add_metric(&Metrics::close_us, action, close_start);
+    if (closed != SSH_OK) {
+        errcode = sftp_get_error(session.sftp);
+        response(                       //
+            action.cmd, id, RES_ERROR, //
+            fmt::format("File upload error , remote: {}, err ({}) {}", abs_remote, errcode, sftp_error_str(errcode)));
+        return Err::sftpError(errcode);
+    }
+
+    if (resume && (errcode = remote_replace(session.sftp, target, abs_remote)) != 0) {
+        response(                       //
+            action.cmd, id, RES_ERROR, //
+            fmt::format("Rename failed: {} -> {}, err ({}) {}", target, abs_remote, errcode, sftp_error_str(errcode)));
+        return Err::sftpError(errcode);
+    }
+
+    if (hasher && !verify_remote(action, *hasher, abs_remote)) { return Err::error(-1); }
+
+    response(                      //
+        action.cmd, id, RES_INFO, //
+        fmt::format("File uploaded successfully {} -> {} ({} bytes, {:.2f} MB/s)", path, abs_remote, offset + written, mb_per_sec(written, start)));
+
+    if (action.skip) copy_mtime(action, abs_local, abs_remote);
+    if (action.metrics) action.metrics->files++;
+    return Err::success();
+}
+
+/** "tar" option: upload files below a size threshold as one tar stream into "tar -x" over an exec channel,
+ * saving the open/write/close round trips per file, larger files keep going through sftp
+ * "tar" alone means 4 KiB, "tar=16K" sets the threshold, "tar_gzip" compresses the stream
+ * not combined with skip or resume, those need per-file remote checks
+ */
+#define TAR_DEFAULT_THRESHOLD 4096
+#define TAR_BLOCK 512
+#define TAR_OUT_CHUNK (64 * 1024)
+
+struct TarBatch
+{
+    uint64_t threshold = 0;
+    std::vector<std::string> files; // relative paths, filled by the walk or the uploads split
+};
+
+uint64_t tar_threshold(const ActionArgs& action)
+{
+    auto value = option_str(action, "tar", "");
+    if (value.empty() || value == "0" || action.skip || resume_mode(action)) { return 0; }
+    return value == "1" ? TAR_DEFAULT_THRESHOLD : parse_bytes(value);
+}
+
+// tar extracts relative names below its -C directory, anything else goes through sftp
+bool tar_name_ok(std::string_view rel)
+{
+    if (rel.empty() || rel.front() == '/') { return false; }
+    for (size_t start = 0; start <= rel.size();) {
+        auto end = std::min(rel.find('/', start), rel.size());
+        if (rel.substr(start, end - start) == "..") { return false; }
+        start = end + 1;
+    }
+    return true;
+}
+
+class TarStream
+{
+  public:
+    TarStream(ssh_channel channel, const PipeParams& params, bool gzip) : channel(channel), params(params), gzip(gzip)
+    {
+        std::memset(&z, 0, sizeof(z));
+        // 15 + 16: gzip wrapper, level 1 keeps up with the link
+        if (gzip) broken = deflateInit2(&z, 1, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK;
+    }
+    ~TarStream()
+    {
+        if (gzip && !broken) deflateEnd(&z);
+    }
+
+    // ustar name: up to 100 bytes, or a prefix of up to 155 split at a '/'
+    static bool split_name(const std::string& name, std::string& prefix, std::string& base)
+    {
+        if (name.size() <= 100) {
+            prefix.clear();
+            base = name;
+            return true;
+        }
+        for (auto slash = name.find('/'); slash != std::string::npos; slash = name.find('/', slash + 1)) {
+            if (slash > 155) { break; }
+            if (name.size() - slash - 1 <= 100) {
+                prefix = name.substr(0, slash);
+                base = name.substr(slash + 1);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool add(const std::string& name, LocalSource& src, uint32_t mode, int64_t mtime)
+    {
+        std::string prefix, base;
+        if (broken || !split_name(name, prefix, base)) { return false; }
+
+        char header[TAR_BLOCK] = {};
+        std::memcpy(header, base.data(), base.size());
+        std::snprintf(header + 100, 8, "%07o", mode & 07777);
+        std::snprintf(header + 108, 8, "%07o", 0);
+        std::snprintf(header + 116, 8, "%07o", 0);
+        std::snprintf(header + 124, 12, "%011llo", (unsigned long long)src.size());
+        std::snprintf(header + 136, 12, "%011llo", (unsigned long long)std::max<int64_t>(mtime, 0));
+        header[156] = '0';
+        std::memcpy(header + 257, "ustar", 6);
+        std::memcpy(header + 263, "00", 2);
+        std::memcpy(header + 345, prefix.data(), prefix.size());
+        std::memset(header + 148, ' ', 8);
+        unsigned sum = 0;
+        for (auto ch : header) sum += (unsigned char)ch;
+        std::snprintf(header + 148, 8, "%06o", sum);
+        header[155] = ' ';
+        if (!put(header, TAR_BLOCK)) { return false; }
+
+        std::vector<char> buffer(TAR_OUT_CHUNK);
+        for (uint64_t offset = 0; offset < src.size();) {
+            auto n = (size_t)std::min<uint64_t>(TAR_OUT_CHUNK, src.size() - offset);
+            auto data = src.view(offset, n, buffer.data());
+            if (!data || !put(data, n)) { return false; }
+            offset += n;
+        }
+        static const char zeros[TAR_BLOCK] = {};
+        auto pad = (TAR_BLOCK - src.size() % TAR_BLOCK) % TAR_BLOCK;
+        return put(zeros, pad);
+    }
+
+    // end of archive is two zero blocks
+    bool finish()
+    {
+        static const char zeros[2 * TAR_BLOCK] = {};
+        if (broken || !put(zeros, sizeof(zeros))) { return false; }
+        if (gzip) {
+            int ret;
+            do {
+                ret = deflate_out(nullptr, 0, Z_FINISH);
+                if (ret < 0) { return false; }
+            } while (ret != Z_STREAM_END);
+        }
+        return send(out.data(), out.size(), true);
+    }
+
+    uint64_t sent = 0; // bytes on the wire
+
+  private:
+    bool put(const char* data, size_t len)
+    {
+        if (!len) { return true; }
+        if (gzip) { return deflate_out(data, len, Z_NO_FLUSH) >= 0; }
+        out.append(data, len);
+        return send(out.data(), out.size(), false);
+    }
+
+    int deflate_out(const char* data, size_t len, int flush)
+    {
+        z.next_in = (Bytef*)data;
+        z.avail_in = (uInt)len;
+        char chunk[TAR_OUT_CHUNK];
+        int ret;
+        do {
+            z.next_out = (Bytef*)chunk;
+            z.avail_out = sizeof(chunk);
+            ret = deflate(&z, flush);
+            if (ret == Z_STREAM_ERROR) { return -1; }
+            out.append(chunk, sizeof(chunk) - z.avail_out);
+            if (!send(out.data(), out.size(), false)) { return -1; }
+        } while (z.avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+        return ret;
+    }
+
+    // writes whole chunks, the rest waits for more unless all
+    bool send(const char* data, size_t len, bool all)
+    {
+        size_t done = 0;
+        while (len - done >= TAR_OUT_CHUNK || (all && done < len)) {
+            auto n = std::min<size_t>(len - done, TAR_OUT_CHUNK);
+            throttle(params, n);
+            if (ssh_channel_write(channel, data + done, (uint32_t)n) != (int)n) { return false; }
+            if (params.progress) params.progress->advance(params.progress->offset + n, n);
+            sent += n;
+            done += n;
+        }
+        out.erase(0, done);
+        return true;
+    }
+
+    ssh_channel channel;
+    const PipeParams& params;
+    bool gzip;
+    bool broken = false;
+    z_stream z;
+    std::string out;
+};
+
+/** send batch.files in one tar stream, untar below the remote root
+ * return the files that still need sftp: all of them when the channel or tar failed, the ones tar cannot name otherwise
+ */
+std::vector<std::string> tar_upload(ActionArgs& action, const TarBatch& batch, int& done)
+{
+    auto& session = *action.session;
+    bool gzip = option_str(action, "tar_gzip", "") != "";
+    std::vector<std::string> left;
+    done = 0;
+    if (batch.files.empty()) { return left; }
+
+    auto root = shell_quote(std::string(action.remoteRoot.empty() ? "." : action.remoteRoot));
+    auto command = fmt::format("mkdir -p {0} && tar -x{1}f - -C {0}", root, gzip ? "z" : "");
+
+    ssh_channel channel = ssh_channel_new(session.ssh);
+    bool opened = channel && ssh_channel_open_session(channel) == SSH_OK;
+    if (!opened || ssh_channel_request_exec(channel, command.c_str()) != SSH_OK) {
+        if (opened) ssh_channel_close(channel);
+        if (channel) ssh_channel_free(channel);
+        action.response(action.cmd, action.id, RES_INFO, "tar channel failed, files go through sftp");
+        return batch.files;
+    }
+
+    auto params = pipe_params(action, session.max_write);
+    auto start = Clock::now();
+    std::vector<std::string> packed;
+    uint64_t bytes = 0, wire = 0;
+    bool ok = true;
+    {
+        TarStream tar(channel, params, gzip);
+        for (auto& rel : batch.files) {
+            LocalSource src;
+            struct stat st;
+            std::string prefix, base;
+            auto abs_local = local_path_of(action, rel);
+            if (!tar_name_ok(rel) || !TarStream::split_name(rel, prefix, base) || ::stat(abs_local.c_str(), &st) != 0 || !src.open(abs_local)) {
+                left.push_back(rel);
+                continue;
+            }
+            if (params.progress) params.progress->begin(rel);
+            if (!tar.add(rel, src, st.st_mode, st.st_mtime)) {
+                ok = false;
+                break;
+            }
+            packed.push_back(rel);
+            bytes += src.size();
+        }
+        ok = ok && tar.finish();
+        wire = tar.sent;
+    }
+    if (params.progress) params.progress->end();
+    ssh_channel_send_eof(channel);
+
+    std::string err;
+    char buffer[4096];
+    int n;
+    while ((n = ssh_channel_read(channel, buffer, sizeof(buffer), 1)) > 0) err.append(buffer, n);
+    while (ssh_channel_read(channel, buffer, sizeof(buffer), 0) > 0) {}
+    int status = ssh_channel_get_exit_status(channel);
+    ssh_channel_close(channel);
+    ssh_channel_free(channel);
+
+    if (!ok || status != 0) {
+        action.response(action.cmd, action.id, RES_INFO, fmt::format("tar upload failed ({}), files go through sftp: {}", status, err));
+        return batch.files;
+    }
+
+    for (auto& rel : packed) {
+        action.response(action.cmd, action.id, RES_INFO, fmt::format("File uploaded successfully {} -> {} (tar)", rel, remote_path_of(action, rel)));
+    }
+    action.response(action.cmd, action.id, RES_INFO,
+                    fmt::format("tar files({}) bytes({}) sent({}) ({:.2f} MB/s)", packed.size(), bytes, wire, mb_per_sec(bytes, start)));
+    if (session.stats) session.stats->done += (int)packed.size();
+    done = (int)packed.size();
+    return left;
+}
+
+/** files of one batch, shared by the lanes of run_batch
+ * producers push paths and close, lanes pop until closed and empty
+ */
+class FileQueue
+{
+  public:
+    void push(std::string path)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            paths.emplace_back(std::move(path));
+            if (pending) (*pending)++;
+        }
+        condition.notify_one();
+    }
+
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        condition.notify_all();
+    }
+
+    bool pop(std::string& path)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [this] { return !paths.empty() || closed; });
+        if (paths.empty()) { return false; }
+        path = std::move(paths.front());
+        paths.pop_front();
+        return true;
+    }
+
+    size_t drain()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto n = paths.size();
+        paths.clear();
+        if (pending) (*pending) -= (int)n;
+        return n;
+    }
+
+    // counter gets the queued paths and every later push, whoever finishes a path takes it off
+    void count_into(std::atomic<int>* counter)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending = counter;
+        if (pending) (*pending) += (int)paths.size();
+    }
+
+  private:
+    std::atomic<int>* pending = nullptr;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<std::string> paths;
+    bool closed = false;
+};
+
+struct BatchResult
+{
+    std::atomic<int> done{0};
+    std::atomic<int> failed{0};
+    std::atomic<int> skipped{0};
+    std::atomic<int> lanes{0};   // lanes that took part
+    std::atomic<int> untried{0}; // left in the queue after every lane died
+};
+
+using TransferOne = Err (*)(ActionArgs& action);
+
+void run_lane(ActionArgs action, SFTPSession* lane, FileQueue& queue, TransferOne transfer, BatchResult& result)
+{
+    action.session = lane;
+    auto* stats = lane->stats.get();
+    auto* progress = lane->progress.get();
+    auto finish = [stats, progress](bool ok) {
+        if (progress) progress->end();
+        if (!stats) { return; }
+        (ok ? stats->done : stats->failed)++;
+        stats->pending--;
+    };
+
+    std::string path;
+    while (queue.pop(path)) {
+        action.path = path;
+        action.err = 0;
+        action.skipped = false;
+        if (progress) progress->begin(path);
+        auto err = transfer(action);
+        if (err && err.isSftpErr()) {
+            action.err = err.code();
+            int r = check_reconnect_action(action);
+            if (r == 0) {
+                err = transfer(action);
+            } else if (r < 0) {
+                result.failed++;
+                finish(false);
+                return; // lane is dead, the others keep draining the queue
+            }
+        }
+        finish(!err);
+        if (err) {
+            result.failed++;
+        } else if (action.skipped) {
+            result.skipped++;
+        } else {
+            result.done++;
+        }
+    }
+}
+
+// "pool" option, extra connections are opt-in
+#define POOL_DEFAULT 1
+#define POOL_MAX 32
+
+size_t pool_size(const ActionArgs& action) { return (size_t)std::clamp(option_int(action, "pool", POOL_DEFAULT), 1LL, (long long)POOL_MAX); }
+
+/** spread the queued files over up to "pool" connections (session option, default 1)
+ * the session itself is lane 0, extra lanes are opened on first use and kept until close_session
+ * files: expected file count, no more lanes than files are used
+ * produce: run on lane 0 before it joins the transfer, fills and closes the queue while the other lanes drain it,
+ *          without it the caller closes the queue
+ * all lanes are joined on return
+ */
+void run_batch(ActionArgs& action, FileQueue& queue, size_t files, TransferOne transfer, BatchResult& result,
+               const std::function<void()>& produce = nullptr)
+{
+    auto& session = *action.session;
+    auto pool = pool_size(action);
+    auto lanes = std::max<size_t>(std::min(pool, files), 1);
+    // the producer holds lane 0's connection, one more lane transfers while it runs
+    if (produce) lanes = std::max<size_t>(lanes, 2);
+
+    while (session.lanes.size() + 1 < lanes) session.lanes.push_back(new_lane(session));
+
+    auto stats = session.stats;
+    if (stats) {
+        queue.count_into(&stats->pending);
+        stats->batch_start_us = elapsed_us(stats->opened);
+        stats->busy = true;
+    }
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < lanes; ++i) {
+        auto* lane = &session.lanes[i - 1];
+        threads.emplace_back([&action, i, lane, &queue, transfer, &result] {
+            // lanes connect in parallel while lane 0 is already transferring
+            auto connect_start = Clock::now();
+            bool connected = lane->ssh || session_init(*lane, quiet_response, action.cmd, action.id);
+            add_metric(&Metrics::connect_us, action, connect_start);
+            if (!connected) {
+                action.response(action.cmd, action.id, RES_INFO, fmt::format("lane {} connect failed, continue without it", i));
+                return;
+            }
+            result.lanes++;
+            run_lane(action, lane, queue, transfer, result);
+        });
+    }
+
+    if (produce) produce();
+    result.lanes++;
+    run_lane(action, &session, queue, transfer, result);
+    for (auto& thread : threads) thread.join();
+
+    // every lane died, whatever is left was never tried
+    result.untried = (int)queue.drain();
+    result.failed += result.untried;
+
+    // spare connections go to the pool between batches, other sessions to the same host take them from there too
+    for (auto& lane : session.lanes) release_login(lane);
+    if (session.stripes) {
+        std::lock_guard<std::mutex> busy(session.stripes->busy);
+        for (auto& conn : session.stripes->conns) release_login(conn);
+    }
+
+    if (stats) {
+        stats->failed += result.untried;
+        stats->busy_us += elapsed_us(stats->opened) - stats->batch_start_us;
+        stats->busy = false;
+        queue.count_into(nullptr);
+    }
+}
+
+
+/** "engine=event": the files of uploads/downloads requests are driven by one process-wide event thread instead of lanes
+ * the sessions with files in flight sit in one ssh_event, each file is a small state machine (open, stream, close),
+ * up to "engine_files" files of a request (default 64) are open at once with their windows of requests in flight,
+ * capped at ENGINE_REQUESTS per request, completions are collected with non-blocking sftp files
+ * libssh has no asynchronous open/close/fstat: the request thread borrows its session out of the event for those,
+ * makes the blocking calls and hands it back, so a slow host only holds up its own files
+ * a rate limit holds back a file's sends until the tokens are there instead of sleeping the loop
+ * not used with resume, verify, delta or stripe, files that fail with an sftp error get a second try through run_batch
+ */
+#define ENGINE_FILES 64
+#define ENGINE_REQUESTS 256
+#define ENGINE_POLL_MS 10
+
+enum
+{
+    ENGINE_OPEN = 0,
+    ENGINE_STREAM = 1,
+    ENGINE_CLOSE = 2, // streamed or failed, waits for the request thread
+    ENGINE_DONE = 3,
+};
+
+Err download_one_file(ActionArgs& action);
+
+struct EngineFile
+{
+    std::string path; // as requested, relative to the roots
+    std::string abs_local;
+    std::string abs_remote;
+    int state = ENGINE_OPEN;
+    bool skipped = false;
+    int errcode = 0; // sftp code or LOCAL_IO_ERROR
+    sftp_file remote = nullptr;
+    LocalSource src; // uploads
+    LocalSink sink;  // downloads
+    uint64_t size = 0;
+    uint64_t requested = 0; // bytes sent / asked for
+    uint64_t done = 0;      // bytes confirmed
+    std::deque<std::pair<sftp_aio, size_t>> inflight;
+    Clock::time_point start;
+};
+
+/** one request's files on its session
+ * the engine thread streams the active files while the session is in its event, the request thread opens and closes
+ * files while it has the session lent, the flags at the end are guarded by the engine mutex
+ */
+struct EngineJob
+{
+    ActionArgs* action;
+    bool upload;
+    PipeParams params;
+    size_t max_open;
+    std::vector<std::unique_ptr<EngineFile>> files;
+    std::vector<EngineFile*> active;  // ENGINE_STREAM
+    std::vector<EngineFile*> closing; // ENGINE_CLOSE
+    std::vector<std::string> retry;   // sftp errors, for the threaded path
+    size_t next = 0;                 // first file not opened yet
+    size_t inflight = 0;             // requests over all files
+    int done = 0;
+    int failed = 0;
+    int skipped = 0;
+    std::vector<char> buffer; // upload chunks of unmapped files, download replies, used one at a time
+    bool want = false;        // the request thread asks for the session
+    bool lent = false;        // the request thread has it, the engine leaves the job alone
+    bool wake = false;        // files are waiting in closing
+    bool leave = false;       // every file is done, the engine drops the job
+    bool gone = false;
+    bool polled = false;      // the session is in the event, engine thread only
+};
+
+#if SFTP_PIP_AIO
+class EventEngine
+{
+  public:
+    // blocks until every file of the job is done or left for a retry
+    void run(EngineJob& job)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!started) {
+            std::thread([this] { loop(); }).detach();
+            started = true;
+        }
+        incoming.push_back(&job);
+        for (;;) {
+            job.want = true;
+            condition.notify_all();
+            condition.wait(lock, [&job] { return job.lent; });
+            lock.unlock();
+
+            // the blocking round trips, only this session waits for them
+            for (auto* file : job.closing) close(job, *file, file->errcode);
+            job.closing.clear();
+            while (job.active.size() < job.max_open && job.next < job.files.size()) open(job, *job.files[job.next++]);
+            bool done = job.next >= job.files.size() && job.active.empty();
+
+            lock.lock();
+            job.want = false;
+            if (done) {
+                job.leave = true;
+                condition.notify_all();
+                condition.wait(lock, [&job] { return job.gone; });
+                return;
+            }
+            job.lent = false;
+            job.wake = false;
+            condition.notify_all();
+            condition.wait(lock, [&job] { return job.wake; });
+        }
+    }
+
+  private:
+    void loop()
+    {
+        ssh_event event = ssh_event_new();
+        std::vector<EngineJob*> jobs;
+        for (;;) {
+            std::vector<EngineJob*> ready;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                // lent jobs have nothing for the loop until they come back
+                condition.wait(lock, [&] {
+                    if (!incoming.empty()) { return true; }
+                    for (auto* job : jobs) {
+                        if (job->leave || !job->lent) { return true; }
+                    }
+                    return false;
+                });
+                jobs.insert(jobs.end(), incoming.begin(), incoming.end());
+                incoming.clear();
+                for (auto it = jobs.begin(); it != jobs.end();) {
+                    auto* job = *it;
+                    if (job->leave) {
+                        if (job->polled) ssh_event_remove_session(event, job->action->session->ssh);
+                        job->gone = true;
+                        it = jobs.erase(it);
+                        continue;
+                    }
+                    if (job->want && !job->lent) {
+                        if (job->polled) ssh_event_remove_session(event, job->action->session->ssh);
+                        job->polled = false;
+                        job->lent = true;
+                    } else if (!job->lent && !job->polled) {
+                        ssh_event_add_session(event, job->action->session->ssh);
+                        job->polled = true;
+                    }
+                    if (!job->lent) ready.push_back(job);
+                    ++it;
+                }
+                condition.notify_all();
+            }
+
+            bool progress = false;
+            for (auto* job : ready) progress = step(*job) || progress;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (auto* job : ready) {
+                    if (!job->closing.empty() && !job->wake) {
+                        job->wake = true;
+                        condition.notify_all();
+                    }
+                }
+            }
+            // nothing moved: sleep until a socket has data
+            if (!progress && !ready.empty()) ssh_event_dopoll(event, ENGINE_POLL_MS);
+        }
+    }
+
+    // streams the active files, the finished ones move to closing
+    static bool step(EngineJob& job)
+    {
+        bool progress = false;
+        for (size_t i = 0; i < job.active.size();) {
+            auto* file = job.active[i];
+            progress = pump(job, *file) || progress;
+            if (file->state == ENGINE_CLOSE) {
+                job.closing.push_back(file);
+                job.active[i] = job.active.back();
+                job.active.pop_back();
+            } else {
+                ++i;
+            }
+        }
+        return progress;
+    }
+
+    static void open(EngineJob& job, EngineFile& file)
+    {
+        auto& action = *job.action;
+        auto& session = *action.session;
+        file.start = Clock::now();
+        if (session.progress) session.progress->begin(file.path);
+        file.abs_local = local_path_of(action, file.path);
+        auto& abs_local = file.abs_local;
+        auto& abs_remote = file.abs_remote;
+        if (job.upload) {
+            abs_remote = remote_path_of(action, file.path);
+            if (!file.src.open(abs_local)) {
+                action.response(action.cmd, action.id, RES_ERROR, fmt::format("Local file open failed | not found: {}", abs_local));
+                return close(job, file, LOCAL_IO_ERROR);
+            }
+            if (action.skip && is_unchanged(action, abs_local, abs_remote)) {
+                action.response(action.cmd, action.id, RES_INFO, fmt::format("File unchanged, skipped {} -> {}", file.path, abs_remote));
+                file.skipped = true;
+                return close(job, file, 0);
+            }
+            file.size = file.src.size();
+            file.remote = open_remote_truncate(session, abs_remote, file.errcode);
+        } else {
+            abs_remote = fs::absolute(fs::path(action.remoteRoot) / file.path).generic_string();
+            file.remote = sftp_open(session.sftp, abs_remote.c_str(), O_RDONLY, 0);
+            bool size_known = false;
+            if (file.remote) {
+                if (auto attrs = sftp_fstat(file.remote)) {
+                    size_known = attrs->flags & SSH_FILEXFER_ATTR_SIZE;
+                    file.size = attrs->size;
+                    sftp_attributes_free(attrs);
+                }
+                // no size to plan the reads with, the threaded path reads to EOF
+                if (!size_known) file.errcode = SSH_FX_FAILURE;
+            } else {
+                file.errcode = sftp_get_error(session.sftp);
+            }
+            std::error_code ec;
+            fs::create_directories(fs::path(abs_local).parent_path(), ec);
+            if (file.remote && size_known && !file.sink.open(abs_local, true)) {
+                action.response(action.cmd, action.id, RES_ERROR, fmt::format("Local file open failed: {}", abs_local));
+                return close(job, file, LOCAL_IO_ERROR);
+            }
+            if (size_known) file.sink.preallocate(file.size);
+        }
+        if (!file.remote) { return close(job, file, file.errcode ? file.errcode : SSH_FX_FAILURE); }
+        if (file.errcode) { return close(job, file, file.errcode); }
+        sftp_file_set_nonblocking(file.remote);
+        note_first_byte(action);
+        file.state = ENGINE_STREAM;
+        job.active.push_back(&file);
+    }
+
+    // send what the windows allow, take the replies that arrived, true when anything moved
+    static bool pump(EngineJob& job, EngineFile& file)
+    {
+        auto& params = job.params;
+        auto& session = *job.action->session;
+        bool progress = false;
+        while (file.errcode == 0 && file.requested < file.size && (int)file.inflight.size() < params.window && job.inflight < ENGINE_REQUESTS) {
+            auto n = (size_t)std::min<uint64_t>(params.chunk, file.size - file.requested);
+            if (!throttle_ready(params, n)) { break; }
+            sftp_aio aio = nullptr;
+            if (job.upload) {
+                auto data = file.src.view(file.requested, n, job.buffer.data());
+                if (!data) {
+                    file.errcode = LOCAL_IO_ERROR;
+                } else if (sftp_aio_begin_write(file.remote, data, n, &aio) != (ssize_t)n) {
+                    file.errcode = sftp_get_error(session.sftp);
+                }
+            } else if (sftp_aio_begin_read(file.remote, n, &aio) != (ssize_t)n) {
+                file.errcode = sftp_get_error(session.sftp);
+            }
+            if (file.errcode) { break; }
+            file.inflight.emplace_back(aio, n);
+            file.requested += n;
+            job.inflight++;
+            progress = true;
+        }
+
+        // replies come in request order per file
+        while (file.errcode == 0 && !file.inflight.empty()) {
+            auto& req = file.inflight.front();
+            ssize_t n = job.upload ? sftp_aio_wait_write(&req.first) : sftp_aio_wait_read(&req.first, job.buffer.data(), job.buffer.size());
+            if (n == SSH_AGAIN) { break; }
+            auto len = req.second;
+            file.inflight.pop_front();
+            job.inflight--;
+            progress = true;
+            if (n < 0) {
+                file.errcode = sftp_get_error(session.sftp);
+            } else if (!job.upload && !file.sink.write_at(file.done, job.buffer.data(), n)) {
+                file.errcode = LOCAL_IO_ERROR;
+            } else if ((size_t)n != len) {
+                // server capped the length or the file changed, the threaded path copes with that
+                file.errcode = SSH_FX_FAILURE;
+            }
+            if (n > 0) {
+                file.done += n;
+                if (session.progress) session.progress->advance(file.done, n);
+            }
+        }
+
+        if (file.errcode || (file.requested >= file.size && file.inflight.empty())) {
+            file.state = ENGINE_CLOSE;
+            progress = true;
+        }
+        return progress;
+    }
+
+    static void close(EngineJob& job, EngineFile& file, int errcode)
+    {
+        auto& action = *job.action;
+        auto& session = *action.session;
+        for (auto& req : file.inflight) sftp_aio_free(req.first);
+        job.inflight -= file.inflight.size();
+        file.inflight.clear();
+        if (file.remote && sftp_close(file.remote) != SSH_OK && errcode == 0) errcode = sftp_get_error(session.sftp);
+        file.remote = nullptr;
+        if (!job.upload && file.sink.is_open() && !file.sink.finish(file.done) && errcode == 0) errcode = LOCAL_IO_ERROR;
+        file.src.close();
+        file.state = ENGINE_DONE;
+        if (session.progress) session.progress->end();
+
+        auto* stats = session.stats.get();
+        if (errcode > 0) {
+            job.retry.push_back(file.path);
+            return;
+        }
+        if (stats) {
+            (errcode ? stats->failed : stats->done)++;
+            stats->pending--;
+        }
+        if (errcode) {
+            job.failed++;
+            return;
+        }
+        if (file.skipped) {
+            job.skipped++;
+            return;
+        }
+        job.done++;
+        if (job.upload) {
+            if (action.skip) copy_mtime(action, file.abs_local, file.abs_remote);
+            action.response(action.cmd, action.id, RES_INFO,
+                            fmt::format("File uploaded successfully {} -> {} ({} bytes, {:.2f} MB/s)", file.path, file.abs_remote, file.done,
+                                        mb_per_sec(file.done, file.start)));
+        } else {
+            action.response(action.cmd, action.id, RES_INFO,
+                            fmt::format("File downloaded successfully {} -> {} ({} bytes, {:.2f} MB/s)", file.abs_remote, file.path, file.done,
+                                        mb_per_sec(file.done, file.start)));
+        }
+        if (action.metrics) action.metrics->files++;
+    }
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::vector<EngineJob*> incoming;
+    bool started = false;
+};
+
+EventEngine event_engine;
+#endif
+
+bool engine_wanted(const ActionArgs& action)
+{
+#if SFTP_PIP_AIO
+    if (option_str(action, "engine", "") != "event" || !action.session->sftp) { return false; }
+    for (auto* key : {"resume", "verify", "delta", "stripe"}) {
+        if (!option_str(action, key, "").empty()) { return false; }
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+// the queued files through the event engine, the ones it could not finish through run_batch
+void engine_batch(ActionArgs& action, FileQueue& queue, bool upload, BatchResult& result)
+{
+#if SFTP_PIP_AIO
+    auto& session = *action.session;
+    EngineJob job;
+    job.action = &action;
+    job.upload = upload;
+    job.params = pipe_params(action, upload ? session.max_write : session.max_read);
+    job.params.progress = nullptr;
+    job.max_open = (size_t)std::clamp(option_int(action, "engine_files", ENGINE_FILES), 1LL, 4096LL);
+    job.buffer.resize(job.params.chunk);
+    std::string path;
+    while (queue.pop(path)) {
+        job.files.push_back(std::make_unique<EngineFile>());
+        job.files.back()->path = path;
+    }
+
+    auto stats = session.stats;
+    if (stats) {
+        stats->pending += (int)job.files.size();
+        stats->batch_start_us = elapsed_us(stats->opened);
+        stats->busy = true;
+    }
+    event_engine.run(job);
+    if (stats) {
+        stats->pending -= (int)job.retry.size();
+        stats->busy_us += elapsed_us(stats->opened) - stats->batch_start_us;
+        stats->busy = false;
+    }
+    result.lanes++;
+    result.done += job.done;
+    result.failed += job.failed;
+    result.skipped += job.skipped;
+    if (job.retry.empty()) { return; }
+
+    action.response(action.cmd, action.id, RES_INFO, fmt::format("engine: {} files again through the lanes", job.retry.size()));
+    FileQueue again;
+    for (auto& rel : job.retry) again.push(rel);
+    again.close();
+    BatchResult rest;
+    run_batch(action, again, job.retry.size(), upload ? upload_one_file : download_one_file, rest);
+    result.done += rest.done;
+    result.failed += rest.failed;
+    result.skipped += rest.skipped;
+    result.untried += rest.untried;
+#else
+    run_batch(action, queue, 1, upload ? upload_one_file : download_one_file, result);
+#endif
+}
+
+void uploads(const ReqHead& head, Msgs& msgs, Responser response)
+{
+
+    ActionArgs actionArgs;
+    actionArgs.id = head.id;
+    actionArgs.cmd = CMD_UPLOADS;
+    actionArgs.localRoot = msgs[1];
+    actionArgs.remoteRoot = msgs[2];
+    actionArgs.response = response;
+    actionArgs.err = 0;
+    actionArgs.options = &head.options;
+    actionArgs.metrics = nullptr;
+    actionArgs.skip = nullptr;
+    actionArgs.skipped = false;
+    auto sessionId = head.sessionId;
+
+    actionArgs.session = find_session(sessionId);
+    if (!actionArgs.session) {
+        response(                                       //
+            CMD_UPLOADS, actionArgs.id, RES_ERROR_DONE, //
+            fmt::format("Session ID ({}) not found", sessionId));
+        return;
+    }
+
+    response(CMD_UPLOADS, head.id, RES_INFO, fmt::format(">>>>>>>>>>>>>> {} start upload files count({})", actionArgs.session->hostname, msgs.size() - 3));
+
+    Metrics metrics;
+    metrics.queue_us = head.queued_us;
+    if (option_int(actionArgs, "metrics", 0)) actionArgs.metrics = &metrics;
+
+    if (!plan_compression(actionArgs, &msgs, 3)) {
+        response(CMD_UPLOADS, actionArgs.id, RES_ERROR_DONE, "Failed to reconnect with the new compression");
+        return;
+    }
+
+    // a single file finds out on open, no need to stat ahead
+    if (msgs.size() > 4) plan_remote_dirs(actionArgs, msgs, 3);
+
+    SkipPlan skip;
+    plan_skip(actionArgs, msgs, 3, skip);
+    if (skip.mode != SKIP_NONE) actionArgs.skip = &skip;
+
+    // small files go ahead in one tar stream while the session is still idle, see tar_upload
+    TarBatch tar;
+    tar.threshold = tar_threshold(actionArgs);
+    FileQueue queue;
+    size_t files = 0;
+    for (size_t i = 3; i < msgs.size(); ++i) {
+        std::error_code ec;
+        auto size = tar.threshold ? fs::file_size(local_path_of(actionArgs, msgs[i]), ec) : 0;
+        if (tar.threshold && !ec && size < tar.threshold) {
+            tar.files.emplace_back(msgs[i]);
+        } else {
+            queue.push(std::string(msgs[i]));
+            files++;
+        }
+    }
+    int tarred = 0;
+    for (auto& rel : tar_upload(actionArgs, tar, tarred)) {
+        queue.push(rel);
+        files++;
+    }
+    queue.close();
+
+    BatchResult result;
+    result.done += tarred;
+    if (engine_wanted(actionArgs)) {
+        engine_batch(actionArgs, queue, true, result);
+    } else {
+        run_batch(actionArgs, queue, files, upload_one_file, result);
+    }
+    report_metrics(actionArgs);
+
+    response(CMD_UPLOADS, actionArgs.id, result.untried > 0 ? RES_ERROR_DONE : RES_DONE,
+             fmt::format("<<<<<<<<<<< {} upload done count({}) failed({}) skipped({}) lanes({}) session({})", actionArgs.session->hostname,
+                         result.done.load(), result.failed.load(), result.skipped.load(), result.lanes.load(), sessionId));
+}
+
+Err download_one_file(ActionArgs& action)
+{
+    auto& session = *action.session;
+    int id = action.id;
+    auto localRoot = action.localRoot;
+    auto remoteRoot = action.remoteRoot;
+    auto path = action.path;
+    auto response = action.response;
+    std::string abs_local = fs::absolute(fs::path(localRoot) / path).string();
+    std::string abs_remote = fs::absolute(fs::path(remoteRoot) / path).generic_string();
+
+    auto open_start = Clock::now();
+    sftp_file remote_file = sftp_open(session.sftp, abs_remote.data(), O_RDONLY, 0);
+    if (!remote_file) {
+        int errcode = sftp_get_error(session.sftp);
+        response(                         //
+            action.cmd, id, RES_ERROR, //
+            fmt::format("Remote file open failed: {}, err ({}): {}", abs_remote, errcode, sftp_error_str(errcode)));
+        if (errcode == SSH_FX_NO_SUCH_FILE || errcode == SSH_FX_PERMISSION_DENIED || errcode == SSH_FX_NO_SUCH_PATH){
+            return Err::error(-2);
+        }else{
+            return Err::sftpError(errcode);
+        }
+    }
+
+    // size picks the read-ahead: small files get one request, no window beyond EOF
+    uint64_t size = 0;
+    bool size_known = false;
+    if (auto attrs = sftp_fstat(remote_file)) {
+        size_known = attrs->flags & SSH_FILEXFER_ATTR_SIZE;
+        size = attrs->size;
+        sftp_attributes_free(attrs);
+    }
+
+    Err striped;
+    if (size_known && transfer_striped(action, false, abs_local, abs_remote, size, striped)) {
+        sftp_close(remote_file);
+        return striped;
+    }
+
+    // resume: write to the part file, continue after what an earlier attempt left there
+    auto resume = size_known ? resume_mode(action) : RESUME_NONE;
+    auto target = resume ? abs_local + PART_SUFFIX : abs_local;
+    uint64_t offset = resume ? local_resume_offset(action, abs_remote, target, size, resume == RESUME_VERIFY) : 0;
+    if (offset && sftp_seek64(remote_file, offset) != SSH_OK) offset = 0;
+
+    std::error_code ec;
+    fs::create_directories(fs::path(abs_local).parent_path(), ec);
+    LocalSink localFile;
+    if (!localFile.open(target, offset == 0)) {
+        response(                         //
+            action.cmd, id, RES_ERROR, //
+            fmt::format("Local file open failed: {}", target));
+        sftp_close(remote_file);
+        return Err::error(-1);
+    }
+    add_metric(&Metrics::open_us, action, open_start);
+    if (offset) response(action.cmd, id, RES_INFO, fmt::format("File download resumed at {} bytes {}", offset, abs_remote));
+
+    auto params = pipe_params(action, session.max_read);
+    if (size_known) {
+        auto requests = (size - offset + params.chunk - 1) / params.chunk;
+        params.window = (int)std::max<uint64_t>(std::min<uint64_t>(params.window, requests), 1);
+    } else {
+        params.window = 1;
+    }
+
+    // the part file keeps the prefix mapped until the hasher is done with it
+    LocalSource prefix;
+    auto hasher = verify_hasher(action, size);
+    if (hasher && offset && !(prefix.open(target) && hash_prefix(*hasher, prefix, offset))) {
+        response(action.cmd, id, RES_ERROR, fmt::format("Local file read failed: {}", target));
+        sftp_close(remote_file);
+        return Err::error(-1);
+    }
+    params.hasher = hasher.get();
+
+    // chunks go to their offset with pwrite into reserved space, the length follows the data (resume reads it)
+    if (size_known) localFile.preallocate(size);
+
+    if (params.progress) params.progress->at(offset, size);
+    note_first_byte(action);
+    auto start = Clock::now();
+    uint64_t received = 0;
+    int errcode = read_remote_stream(remote_file, localFile, session.sftp, params, offset, size - offset, received);
+    add_metric(&Metrics::transfer_us, action, start);
+    auto close_start = Clock::now();
+    sftp_close(remote_file);
+    bool written = localFile.finish(offset + received);
+    add_metric(&Metrics::close_us, action, close_start);
+
+    if (errcode != 0 && errcode != LOCAL_IO_ERROR) {
+        response(                          //
+            action.cmd, id, RES_ERROR, //
+            fmt::format("File download error , remote: {}, err ({}) {}", abs_remote, errcode, sftp_error_str(errcode)));
+        return Err::sftpError(errcode);
+    }
+    if (errcode == LOCAL_IO_ERROR || !written) {
+        response(                          //
+            action.cmd, id, RES_ERROR, //
+            fmt::format("Local file write failed: {}", target));
+        return Err::error(-1);
+    }
+
+    if (resume) {
+        fs::rename(target, abs_local, ec);
+        if (ec) {
+            response(action.cmd, id, RES_ERROR, fmt::format("Rename failed: {} -> {}, {}", target, abs_local, ec.message()));
+            return Err::error(-1);
+        }
+    }
+
+    // a corrupt copy must not be mistaken for a finished one by the next attempt
+    if (hasher && !verify_remote(action, *hasher, abs_remote)) {
+        fs::remove(abs_local, ec);
+        return Err::error(-1);
+    }
+
+    response(                        //
+        action.cmd, id, RES_INFO, //
+        fmt::format("File downloaded successfully {} -> {} ({} bytes, {:.2f} MB/s)", abs_remote, path, offset + received, mb_per_sec(received, start)));
+    if (action.metrics) action.metrics->files++;
+    return Err::success();
+}
+
+void downloads(const ReqHead& head, Msgs& msgs, Responser response)
+{
+
+    ActionArgs actionArgs;
+    actionArgs.id = head.id;
+    actionArgs.cmd = CMD_DOWNLOADS;
+    actionArgs.localRoot = msgs[1];
+    actionArgs.remoteRoot = msgs[2];
+    actionArgs.response = response;
+    actionArgs.err = 0;
+    actionArgs.options = &head.options;
+    actionArgs.metrics = nullptr;
+    actionArgs.skip = nullptr;
+    actionArgs.skipped = false;
+    auto sessionId = head.sessionId;
+
+    actionArgs.session = find_session(sessionId);
+    if (!actionArgs.session) {
+        response(                                         //
+            CMD_DOWNLOADS, actionArgs.id, RES_ERROR_DONE, //
+            fmt::format("Session ID ({}) not found", sessionId));
+        return;
+    }
+
+    response(CMD_DOWNLOADS, head.id, RES_INFO, fmt::format(">>>>>>>>>>>>>> {} start download files count({})", actionArgs.session->hostname, msgs.size() - 3));
+
+    Metrics metrics;
+    metrics.queue_us = head.queued_us;
+    if (option_int(actionArgs, "metrics", 0)) actionArgs.metrics = &metrics;
+
+    FileQueue queue;
+    for (size_t i = 3; i < msgs.size(); ++i) queue.push(std::string(msgs[i]));
+    queue.close();
+
+    BatchResult result;
+    if (engine_wanted(actionArgs)) {
+        engine_batch(actionArgs, queue, false, result);
+    } else {
+        run_batch(actionArgs, queue, msgs.size() - 3, download_one_file, result);
+    }
+    report_metrics(actionArgs);
+
+    response(CMD_DOWNLOADS, actionArgs.id, result.untried > 0 ? RES_ERROR_DONE : RES_DONE,
+             fmt::format("<<<<<<<<<<< {} downboad done count({}) failed({}) lanes({}) session({})", actionArgs.session->hostname, result.done.load(),
+                         result.failed.load(), result.lanes.load(), sessionId));
+}
+
+/** "+glob" includes, "-glob" excludes, no include means everything
+ * a glob without '/' matches the file name, otherwise the whole relative path
+ */
+struct TreeFilter
+{
+    std::vector<std::string> include;
+    std::vector<std::string> exclude;
+};
+
+// '*' and '?' stop at '/', "**" crosses directories
+bool glob_match(std::string_view pattern, std::string_view text)
+{
+    if (pattern.empty()) { return text.empty(); }
+    if (pattern.substr(0, 2) == "**") {
+        auto rest = pattern.substr(2);
+        if (!rest.empty() && rest[0] == '/') {
+            // "**/x" also matches "x" at the top
+            if (glob_match(rest.substr(1), text)) { return true; }
+        }
+        for (size_t i = 0; i <= text.size(); ++i) {
+            if (glob_match(rest, text.substr(i))) { return true; }
+        }
+        return false;
+    }
+    if (pattern[0] == '*') {
+        for (size_t i = 0; i <= text.size(); ++i) {
+            if (glob_match(pattern.substr(1), text.substr(i))) { return true; }
+            if (i < text.size() && text[i] == '/') { break; }
+        }
+        return false;
+    }
+    if (text.empty()) { return false; }
+    if (pattern[0] == '?' ? text[0] != '/' : pattern[0] == text[0]) { return glob_match(pattern.substr(1), text.substr(1)); }
+    return false;
+}
+
+bool filter_one(const std::vector<std::string>& globs, std::string_view rel)
+{
+    auto slash = rel.find_last_of('/');
+    auto name = slash == std::string_view::npos ? rel : rel.substr(slash + 1);
+    for (auto& glob : globs) {
+        if (glob_match(glob, glob.find('/') == std::string::npos ? name : rel)) { return true; }
+    }
+    return false;
+}
+
+bool tree_filter_pass(const TreeFilter& filter, std::string_view rel)
+{
+    if (!filter.include.empty() && !filter_one(filter.include, rel)) { return false; }
+    return !filter_one(filter.exclude, rel);
+}
+
+void parse_tree_filter(const Msgs& msgs, size_t first, TreeFilter& filter)
+{
+    for (size_t i = first; i < msgs.size(); ++i) {
+        auto& line = msgs[i];
+        if (line.size() < 2) { continue; }
+        if (line[0] == '+') filter.include.emplace_back(line.substr(1));
+        if (line[0] == '-') filter.exclude.emplace_back(line.substr(1));
+    }
+}
+
+// local walk, relative generic paths go straight into the queue
+// tar: when given, files below its threshold are collected there instead of queued
+void walk_local_tree(ActionArgs& action, const TreeFilter& filter, FileQueue& queue, TarBatch* tar)
+{
+    std::error_code ec;
+    fs::path root = fs::absolute(fs::path(action.localRoot));
+    fs::recursive_directory_iterator it(root, fs::directory_options::skip_permission_denied, ec), end;
+    if (ec) {
+        action.response(action.cmd, action.id, RES_ERROR, fmt::format("Local dir open failed: {}, {}", root.string(), ec.message()));
+    }
+    for (; !ec && it != end; it.increment(ec)) {
+        if (!it->is_regular_file(ec)) { continue; }
+        auto rel = fs::relative(it->path(), root, ec).generic_string();
+        if (!ec && tree_filter_pass(filter, rel)) {
+            if (tar && it->file_size(ec) < tar->threshold && !ec) {
+                tar->files.push_back(rel);
+            } else {
+                queue.push(rel);
+            }
+        }
+        ec.clear();
+    }
+    queue.close();
+}
+
+// remote walk over sftp_opendir/sftp_readdir, breadth first
+void walk_remote_tree(ActionArgs& action, const TreeFilter& filter, FileQueue& queue)
+{
+    auto sftp = action.session->sftp;
+    std::string root(action.remoteRoot);
+    while (root.size() > 1 && root.back() == '/') root.pop_back();
+
+    std::deque<std::string> dirs{""};
+    while (!dirs.empty()) {
+        auto rel_dir = std::move(dirs.front());
+        dirs.pop_front();
+        auto abs_dir = rel_dir.empty() ? root : root + "/" + rel_dir;
+        auto dir = sftp_opendir(sftp, abs_dir.c_str());
+        if (!dir) {
+            int errcode = sftp_get_error(sftp);
+            action.response(action.cmd, action.id, RES_ERROR, fmt::format("Remote dir open failed: {}, {}", abs_dir, sftp_error_str(errcode)));
+            continue;
+        }
+        sftp_attributes attrs;
+        while ((attrs = sftp_readdir(sftp, dir))) {
+            std::string name = attrs->name ? attrs->name : "";
+            if (name != "" && name != "." && name != "..") {
+                auto rel = rel_dir.empty() ? name : rel_dir + "/" + name;
+                if (attrs->type == SSH_FILEXFER_TYPE_DIRECTORY) {
+                    dirs.push_back(rel);
+                } else if (attrs->type == SSH_FILEXFER_TYPE_REGULAR && tree_filter_pass(filter, rel)) {
+                    queue.push(rel);
+                }
+            }
+            sftp_attributes_free(attrs);
+        }
+        sftp_closedir(dir);
+    }
+    queue.close();
+}
+
+void transfer_tree(const ReqHead& head, Msgs& msgs, Responser response, bool upload)
+{
+    auto cmd = upload ? CMD_UPLOAD_DIR : CMD_DOWNLOAD_DIR;
+    ActionArgs actionArgs;
+    actionArgs.id = head.id;
+    actionArgs.cmd = cmd;
+    actionArgs.localRoot = msgs[1];
+    actionArgs.remoteRoot = msgs[2];
+    actionArgs.response = response;
+    actionArgs.err = 0;
+    actionArgs.options = &head.options;
+    actionArgs.metrics = nullptr;
+    actionArgs.skip = nullptr;
+    actionArgs.skipped = false;
+    auto sessionId = head.sessionId;
+
+    actionArgs.session = find_session(sessionId);
+    if (!actionArgs.session) {
+        response(                             //
+            cmd, actionArgs.id, RES_ERROR_DONE, //
+            fmt::format("Session ID ({}) not found", sessionId));
+        return;
+    }
+
+    response(cmd, head.id, RES_INFO,
+             fmt::format(">>>>>>>>>>>>>> {} start {} tree {} -> {}", actionArgs.session->hostname, upload ? "upload" : "download",
+                         upload ? msgs[1] : msgs[2], upload ? msgs[2] : msgs[1]));
+
+    Metrics metrics;
+    metrics.queue_us = head.queued_us;
+    if (option_int(actionArgs, "metrics", 0)) actionArgs.metrics = &metrics;
+
+    TreeFilter filter;
+    parse_tree_filter(msgs, 3, filter);
+
+    // the lanes already transfer what the walk found while it goes on
+    FileQueue queue;
+    BatchResult result;
+    SkipPlan skip;
+    auto pool = pool_size(actionArgs);
+    if (upload) {
+        if (!plan_compression(actionArgs, nullptr, 0)) {
+            response(cmd, actionArgs.id, RES_ERROR_DONE, "Failed to reconnect with the new compression");
+            return;
+        }
+        if (!option_str(actionArgs, "skip", "").empty()) {
+            // the plan needs the whole list, the walk finishes before the lanes start
+            FileQueue walked;
+            walk_local_tree(actionArgs, filter, walked, nullptr);
+            std::vector<std::string> paths;
+            for (std::string rel; walked.pop(rel);) paths.push_back(std::move(rel));
+            Msgs list(paths.begin(), paths.end());
+            plan_skip(actionArgs, list, 0, skip);
+            if (skip.mode != SKIP_NONE) actionArgs.skip = &skip;
+            for (auto& rel : paths) queue.push(rel);
+            queue.close();
+        }
+        TarBatch tar;
+        tar.threshold = tar_threshold(actionArgs);
+        if (actionArgs.skip) {
+            run_batch(actionArgs, queue, pool, upload_one_file, result);
+        } else {
+            // the local walk needs no connection, lane 0 transfers from the start
+            std::thread walker([&] { walk_local_tree(actionArgs, filter, queue, tar.threshold ? &tar : nullptr); });
+            run_batch(actionArgs, queue, pool, upload_one_file, result);
+            walker.join();
+            // every lane died before the walk was done
+            auto late = (int)queue.drain();
+            result.untried += late;
+            result.failed += late;
+        }
+
+        // the lanes are done with the session, the small files follow in one stream
+        int tarred = 0;
+        auto left = tar_upload(actionArgs, tar, tarred);
+        result.done += tarred;
+        if (!left.empty()) {
+            FileQueue rest;
+            for (auto& rel : left) rest.push(rel);
+            rest.close();
+            BatchResult more;
+            run_batch(actionArgs, rest, left.size(), upload_one_file, more);
+            result.done += more.done;
+            result.failed += more.failed;
+            result.untried += more.untried;
+        }
+    } else {
+        run_batch(actionArgs, queue, pool, download_one_file, result, [&] { walk_remote_tree(actionArgs, filter, queue); });
+    }
+    report_metrics(actionArgs);
+
+    response(cmd, actionArgs.id, result.untried > 0 ? RES_ERROR_DONE : RES_DONE,
+             fmt::format("<<<<<<<<<<< {} {} tree done count({}) failed({}) skipped({}) lanes({}) session({})", actionArgs.session->hostname,
+                         upload ? "upload" : "download", result.done.load(), result.failed.load(), result.skipped.load(), result.lanes.load(),
+                         sessionId));
+}
+
+void upload_dir(const ReqHead& head, Msgs& msgs, Responser response) { transfer_tree(head, msgs, response, true); }
+
+void download_dir(const ReqHead& head, Msgs& msgs, Responser response) { transfer_tree(head, msgs, response, false); }
+
+/** fan-out: the same files to several sessions, read once
+ * the request thread reads each chunk into a FanoutChunk shared by every host (mapped files without a copy),
+ * each host writes from its own queue on its own thread, a slow host falls behind until it has
+ * "fanout_buffer" bytes queued, then the reader waits for it
+ */
+#define FANOUT_BUFFER (64 * 1024 * 1024)
+
+struct FanoutChunk
+{
+    std::shared_ptr<LocalSource> source; // keeps the mapping until the last host has written from it
+    std::vector<char> copy;              // the data when the file is not mapped
+    const char* data = nullptr;
+    size_t len = 0;
+};
+
+// a file is its chunks in order, then a closing item without a chunk
+struct FanoutItem
+{
+    size_t file; // request line of the path
+    std::shared_ptr<const FanoutChunk> chunk;
+    bool local_failed = false; // closing item of a file the reader could not read
+};
+
+struct FanoutHost
+{
+    int sessionId = 0;
+    SFTPSession* session = nullptr;
+    int done = 0;
+    int failed = 0;
+    uint64_t bytes = 0;
+    bool dead = false; // lost its connection for good, the reader stops feeding it
+
+    // reader side, waits while the host is over budget
+    void push(FanoutItem&& item, size_t budget)
+    {
+        auto len = item.chunk ? item.chunk->len : 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [&] { return dead || queued == 0 || queued + len <= budget; });
+        if (dead) { return; }
+        queued += len;
+        items.push_back(std::move(item));
+        condition.notify_all();
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        condition.notify_all();
+    }
+
+    bool pop(FanoutItem& item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [this] { return !items.empty() || closed || dead; });
+        if (items.empty()) { return false; }
+        item = std::move(items.front());
+        items.pop_front();
+        queued -= item.chunk ? item.chunk->len : 0;
+        condition.notify_all();
+        return true;
+    }
+
+    void kill()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        dead = true;
+        items.clear();
+        queued = 0;
+        condition.notify_all();
+    }
+
+  private:
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<FanoutItem> items;
+    size_t queued = 0; // chunk bytes in items
+    bool closed = false;
+};
+
+
+/** one host: open on the first item of a file, write its chunks, close on the closing item
+ * the chunks go to "<target>.sftp_pip.part", renamed over the target once the file is complete,
+ * a file cut short by the reader or the host is dropped, after a reconnect it gets one more try from the local file
+ */
+void fanout_host(ActionArgs action, FanoutHost& host, const Msgs& msgs)
+{
+    action.session = host.session;
+    auto& session = *host.session;
+    auto params = pipe_params(action, session.max_write);
+    int files = (int)msgs.size() - 4;
+    auto* stats = session.stats.get();
+    auto* progress = session.progress.get();
+    if (stats) {
+        stats->pending += files;
+        stats->batch_start_us = elapsed_us(stats->opened);
+        stats->busy = true;
+    }
+    if (files > 1) plan_remote_dirs(action, msgs, 4);
+
+    sftp_file remote_file = nullptr;
+    size_t current = 0;
+    int errcode = 0;
+    uint64_t written = 0;
+    std::error_code ec;
+#if SFTP_PIP_AIO
+    std::deque<std::pair<sftp_aio, ssize_t>> inflight;
+#endif
+    // wait until at most keep writes are in flight, the first error stays in errcode
+    auto drain = [&](size_t keep) {
+#if SFTP_PIP_AIO
+        while (inflight.size() > keep) {
+            auto req = inflight.front();
+            inflight.pop_front();
+            if (errcode) {
+                sftp_aio_free(req.first);
+            } else if (sftp_aio_wait_write(&req.first) != req.second) {
+                errcode = sftp_get_error(session.sftp);
+            } else {
+                written += req.second;
+                if (progress) progress->advance(written, req.second);
+            }
+        }
+#endif
+    };
+
+    FanoutItem item;
+    while (host.pop(item)) {
+        auto abs_remote = remote_path_of(action, msgs[item.file]);
+        auto part = abs_remote + PART_SUFFIX;
+        if (item.file != current) {
+            current = item.file;
+            written = 0;
+            errcode = 0;
+            if (progress) progress->begin(msgs[item.file]);
+            if (!item.local_failed) remote_file = open_remote_truncate(session, part, errcode);
+        }
+
+        if (item.chunk) {
+            auto& chunk = *item.chunk;
+            if (!remote_file || errcode) { continue; }
+            throttle(params, chunk.len);
+            if (params.window <= 1) {
+                if (sftp_write(remote_file, chunk.data, chunk.len) != (ssize_t)chunk.len) {
+                    errcode = sftp_get_error(session.sftp);
+                    continue;
+                }
+                written += chunk.len;
+                if (progress) progress->advance(written, chunk.len);
+                continue;
+            }
+#if SFTP_PIP_AIO
+            // the packet is sent right away, the chunk may go once the call returns
+            sftp_aio aio = nullptr;
+            if (sftp_aio_begin_write(remote_file, chunk.data, chunk.len, &aio) != (ssize_t)chunk.len) {
+                errcode = sftp_get_error(session.sftp);
+                continue;
+            }
+            inflight.emplace_back(aio, chunk.len);
+            drain(params.window - 1);
+#endif
+            continue;
+        }
+
+        drain(0);
+        bool opened = remote_file != nullptr;
+        if (remote_file && sftp_close(remote_file) != SSH_OK && !errcode) errcode = sftp_get_error(session.sftp);
+        remote_file = nullptr;
+        current = 0;
+        if (opened && !errcode && !item.local_failed) errcode = remote_replace(session.sftp, part, abs_remote);
+        bool ok = opened && !errcode && !item.local_failed;
+        if (opened && !ok) sftp_unlink(session.sftp, part.c_str());
+        host.bytes += ok ? written : 0;
+
+        int reconnect = 1;
+        if (!ok && !item.local_failed) {
+            action.response(action.cmd, action.id, RES_ERROR, fmt::format("Fan-out upload failed: session({}) {}, err ({}) {}", host.sessionId,
+                                                                          abs_remote, errcode, sftp_error_str(errcode)));
+            action.err = errcode;
+            reconnect = check_reconnect_action(action);
+        }
+        if (reconnect == 0) {
+            // the chunks are gone, the retry reads the local file on its own
+            action.path = std::string(msgs[item.file]);
+            action.err = 0;
+            ok = !upload_one_file(action);
+            auto size = fs::file_size(local_path_of(action, msgs[item.file]), ec);
+            if (ok && !ec) host.bytes += size;
+        }
+        (ok ? host.done : host.failed)++;
+        if (progress) progress->end();
+        if (stats) {
+            (ok ? stats->done : stats->failed)++;
+            stats->pending--;
+        }
+        if (reconnect < 0) {
+            host.kill();
+            break;
+        }
+    }
+
+    // a file cut short by a lost connection
+    drain(0);
+    if (remote_file) sftp_close(remote_file);
+
+    auto untried = files - host.done - host.failed;
+    host.failed += untried;
+    if (stats) {
+        stats->failed += untried;
+        stats->pending -= untried;
+        stats->busy_us += elapsed_us(stats->opened) - stats->batch_start_us;
+        stats->busy = false;
+    }
+}
+
+void fanout_uploads(const ReqHead& head, Msgs& msgs, Responser response)
+{
+    ActionArgs actionArgs;
+    actionArgs.id = head.id;
+    actionArgs.cmd = CMD_FANOUT;
+    actionArgs.response = response;
+    actionArgs.err = 0;
+    actionArgs.options = &head.options;
+    actionArgs.metrics = nullptr;
+    actionArgs.skip = nullptr;
+    actionArgs.skipped = false;
+    actionArgs.session = nullptr;
+    if (msgs.size() < 4) {
+        response(CMD_FANOUT, head.id, RES_ERROR_DONE, "Fan-out needs session ids, local root and remote root");
+        return;
+    }
+    actionArgs.localRoot = msgs[2];
+    actionArgs.remoteRoot = msgs[3];
+
+    std::vector<std::unique_ptr<FanoutHost>> hosts;
+    std::istringstream ids{std::string(msgs[1])};
+    for (int sessionId; ids >> sessionId;) {
+        auto exists = [sessionId](const std::unique_ptr<FanoutHost>& host) { return host->sessionId == sessionId; };
+        if (std::any_of(hosts.begin(), hosts.end(), exists)) { continue; }
+        auto* session = find_session(sessionId);
+        if (!session) {
+            response(CMD_FANOUT, head.id, RES_ERROR, fmt::format("Session ID ({}) not found", sessionId));
+            continue;
+        }
+        touch_session(sessionId);
+        auto host = std::make_unique<FanoutHost>();
+        host->sessionId = sessionId;
+        host->session = session;
+        hosts.push_back(std::move(host));
+    }
+    if (hosts.empty()) {
+        response(CMD_FANOUT, head.id, RES_ERROR_DONE, fmt::format("No session of ({}) found", msgs[1]));
+        return;
+    }
+
+    // one chunk is one write request on every host, so it fits the smallest server limit
+    size_t chunk = SIZE_MAX;
+    for (auto& host : hosts) {
+        actionArgs.session = host->session;
+        chunk = std::min(chunk, pipe_params(actionArgs, host->session->max_write).chunk);
+    }
+    actionArgs.session = hosts[0]->session;
+    auto it = head.options.find("fanout_buffer");
+    auto buffer = it != head.options.end() ? parse_bytes(it->second) : 0;
+    auto budget = (size_t)std::max<uint64_t>(buffer ? buffer : FANOUT_BUFFER, chunk);
+
+    response(CMD_FANOUT, head.id, RES_INFO, fmt::format(">>>>>>>>>>>>>> fan-out upload files count({}) sessions({})", msgs.size() - 4, hosts.size()));
+
+    std::vector<std::thread> threads;
+    for (auto& host : hosts) threads.emplace_back(fanout_host, actionArgs, std::ref(*host), std::cref(msgs));
+
+    for (size_t i = 4; i < msgs.size(); ++i) {
+        auto abs_local = local_path_of(actionArgs, msgs[i]);
+        auto source = std::make_shared<LocalSource>();
+        bool ok = source->open(abs_local);
+        if (!ok) response(CMD_FANOUT, head.id, RES_ERROR, fmt::format("Local file open failed | not found: {}", abs_local));
+        for (uint64_t offset = 0; ok && offset < source->size(); offset += chunk) {
+            auto part = std::make_shared<FanoutChunk>();
+            part->len = (size_t)std::min<uint64_t>(chunk, source->size() - offset);
+            if (source->mapped()) {
+                part->source = source;
+                part->data = source->view(offset, part->len, nullptr);
             } else {
-                response(                       //
-                    CMD_UPLOADS, id, RES_ERROR, //
-                    fmt::format("ensure remote dir failed: {}", err));
-                return Err::sftpError(errcode);
+                part->copy.resize(part->len);
+                part->data = source->view(offset, part->len, part->copy.data());
             }
+            if (!part->data) {
+                response(CMD_FANOUT, head.id, RES_ERROR, fmt::format("Local file read failed: {}", abs_local));
+                ok = false;
+                break;
+            }
+            for (auto& host : hosts) host->push(FanoutItem{i, part}, budget);
         }
-        if (!remote_file) {
-            response(                       //
-                CMD_UPLOADS, id, RES_ERROR, //
-                fmt::format("Remote file open failed: {}, {}", abs_remote, sftp_error_str(errcode)));
-            return Err::sftpError(errcode);
-        }
+        for (auto& host : hosts) host->push(FanoutItem{i, nullptr, !ok}, budget);
     }
+    for (auto& host : hosts) host->close();
+    for (auto& thread : threads) thread.join();
 
-    char buffer[4096];
-    auto uploadOk = true;
-    while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0) {
-        if (sftp_write(remote_file, buffer, file.gcount()) != file.gcount()) {
-            int errcode = sftp_get_error(session.sftp);
-            uploadOk = false;
-            response(                       //
-                CMD_UPLOADS, id, RES_ERROR, //
-                fmt::format("File upload error , remote: {}, err ({}) {}", abs_remote, errcode, sftp_error_str(errcode)));
-            sftp_close(remote_file);
-            return Err::sftpError(errcode);
+    std::string summary;
+    bool lost = false;
+    for (auto& host : hosts) {
+        summary += fmt::format(" session({}) {} done({}) failed({}) bytes({}){}", host->sessionId, host->session->hostname, host->done, host->failed,
+                               host->bytes, host->dead ? " lost" : "");
+        lost = lost || host->dead;
+    }
+    response(CMD_FANOUT, head.id, lost ? RES_ERROR_DONE : RES_DONE,
+             fmt::format("<<<<<<<<<<< fan-out upload done count({}) sessions({}){}", msgs.size() - 4, hosts.size(), summary));
+}
+
+/** watch: inotify on a local tree, changes are coalesced and handed to the scheduler as
+ * uploads/remove requests on the watch's session, so they queue behind whatever the session runs
+ * a batch is flushed once the tree has been quiet for "debounce" ms (default 200),
+ * or WATCH_MAX_DELAY_MS after its first change, or at WATCH_MAX_BATCH paths
+ */
+#define WATCH_DEBOUNCE_MS 200
+#define WATCH_MAX_DELAY_MS 2000
+#define WATCH_MAX_BATCH 10000
+
+Submitter submitter = nullptr;
+std::atomic<int> internal_request_id{1 << 30}; // ids of requests made inside, apart from the client's
+
+void set_submitter(Submitter submit) { submitter = submit; }
+
+struct Watch
+{
+    int id; // the watch request's id, batch reports use it
+    int sessionId;
+    std::string localRoot;
+    std::string remoteRoot;
+    TreeFilter filter;
+    std::string options; // head tokens passed on to the generated requests
+    int debounce_ms;
+    Responser response;
+    std::atomic<bool> stop{false};
+    std::thread thread; // joined by stop_watches
+};
+
+std::mutex watches_mutex;
+std::unordered_map<int, std::shared_ptr<Watch>> watches;
+
+enum
+{
+    WATCH_UPLOAD,
+    WATCH_DELETE_FILE,
+    WATCH_DELETE_DIR,
+};
+
+std::string join_rel(const std::string& dir, std::string_view name) { return dir.empty() ? std::string(name) : dir + "/" + std::string(name); }
+
+void flush_watch(Watch& watch, std::unordered_map<std::string, int>& changes)
+{
+    std::vector<std::string> uploads, files, dirs;
+    for (auto& change : changes) {
+        std::error_code ec;
+        auto abs_local = fs::path(watch.localRoot) / change.first;
+        // the last word is the tree as it is now
+        if (change.second == WATCH_UPLOAD && fs::is_regular_file(abs_local, ec)) {
+            uploads.push_back(change.first);
+        } else if (change.second == WATCH_DELETE_DIR) {
+            dirs.push_back(change.first);
+        } else if (!fs::exists(abs_local, ec)) {
+            files.push_back(change.first);
         }
     }
+    changes.clear();
 
-    if (uploadOk) {
-        response(                      //
-            CMD_UPLOADS, id, RES_INFO, //
-            fmt::format("File uploaded successfully {} -> {}", path, abs_remote));
+    // children before parents, rmdir only takes empty directories
+    auto depth = [](const std::string& path) { return std::count(path.begin(), path.end(), '/'); };
+    std::sort(dirs.begin(), dirs.end(), [&depth](const std::string& a, const std::string& b) { return depth(a) > depth(b); });
+
+    auto upload_count = uploads.size(), delete_count = files.size() + dirs.size();
+    std::string ids;
+    auto submit = [&](int cmd, std::vector<std::string> lines, const char* extra) {
+        int id = internal_request_id++;
+        lines.insert(lines.begin(), fmt::format("{} {} {}{}{}", cmd, id, watch.sessionId, watch.options, extra));
+        submitter(lines);
+        ids += ids.empty() ? std::to_string(id) : "," + std::to_string(id);
+    };
+    if (!uploads.empty()) {
+        uploads.insert(uploads.begin(), {watch.localRoot, watch.remoteRoot});
+        submit(CMD_UPLOADS, std::move(uploads), "");
     }
+    // removes run in order, files first, then the directories children first,
+    // a directory moved out of the tree arrives as one event, its remote copy goes with all it holds
+    if (!files.empty() || !dirs.empty()) {
+        files.insert(files.end(), dirs.begin(), dirs.end());
+        files.insert(files.begin(), watch.remoteRoot);
+        submit(CMD_REMOVE, std::move(files), " recursive=1");
+    }
+    if (ids.empty()) { return; }
 
-    return Err::success();
+    watch.response(CMD_WATCH, watch.id, RES_INFO, fmt::format("watch batch uploads({}) deletes({}) requests({})", upload_count, delete_count, ids));
 }
 
-void uploads(const ReqHead& head, std::vector<std::string>& msgs, Responser response)
+#ifdef __linux__
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+void watch_loop(std::shared_ptr<Watch> watch)
 {
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        watch->response(CMD_WATCH, watch->id, RES_ERROR, fmt::format("inotify failed: {}", std::strerror(errno)));
+        return;
+    }
 
-    ActionArgs actionArgs;
-    actionArgs.id = head.id;
-    actionArgs.localRoot = msgs[1];
-    actionArgs.remoteRoot = msgs[2];
-    actionArgs.response = response;
-    auto sessionId = head.sessionId;
+    std::unordered_map<int, std::string> dirs; // watch descriptor -> relative dir, "" is the root
+    std::unordered_map<std::string, int> changes;
+    Clock::time_point first, last;
+    auto change = [&](const std::string& rel, int what) {
+        if (changes.empty()) first = Clock::now();
+        last = Clock::now();
+        changes[rel] = what;
+    };
 
-    if (!sftp_sessions.count(sessionId)) {
-        response(                                       //
-            CMD_UPLOADS, actionArgs.id, RES_ERROR_DONE, //
-            fmt::format("Session ID ({}) not found", sessionId));
+    // new directories are watched before their files are listed, so nothing falls between
+    auto add_tree = [&](const std::string& rel, bool report_files) {
+        auto root = fs::path(watch->localRoot);
+        auto add_dir = [&](const std::string& dir) {
+            int wd = inotify_add_watch(fd, (root / dir).c_str(), WATCH_EVENTS);
+            if (wd >= 0) {
+                dirs[wd] = dir;
+            } else {
+                watch->response(CMD_WATCH, watch->id, RES_INFO, fmt::format("watch failed: {}, {}", (root / dir).string(), std::strerror(errno)));
+            }
+        };
+        add_dir(rel);
+        std::error_code ec;
+        for (fs::recursive_directory_iterator it(root / rel, fs::directory_options::skip_permission_denied, ec), end; !ec && it != end;
+             it.increment(ec)) {
+            auto sub = fs::relative(it->path(), root, ec).generic_string();
+            if (ec) { break; }
+            if (it->is_directory(ec)) {
+                add_dir(sub);
+            } else if (report_files && it->is_regular_file(ec) && tree_filter_pass(watch->filter, sub)) {
+                change(sub, WATCH_UPLOAD);
+            }
+        }
+    };
+    add_tree("", false);
+
+    // a moved-away directory keeps its watches, under a name that no longer fits
+    auto drop_tree = [&](const std::string& rel) {
+        for (auto it = dirs.begin(); it != dirs.end();) {
+            if (it->second == rel || it->second.rfind(rel + "/", 0) == 0) {
+                inotify_rm_watch(fd, it->first);
+                it = dirs.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    };
+
+    alignas(struct inotify_event) char buffer[64 * 1024];
+    while (!watch->stop) {
+        pollfd pfd{fd, POLLIN, 0};
+        if (poll(&pfd, 1, changes.empty() ? 200 : 50) > 0) {
+            ssize_t len;
+            while ((len = read(fd, buffer, sizeof(buffer))) > 0) {
+                for (char* p = buffer; p < buffer + len;) {
+                    auto* ev = (struct inotify_event*)p;
+                    p += sizeof(struct inotify_event) + ev->len;
+
+                    if (ev->mask & IN_Q_OVERFLOW) {
+                        // events were lost, everything may have changed
+                        add_tree("", true);
+                        continue;
+                    }
+                    if (ev->mask & IN_IGNORED) {
+                        dirs.erase(ev->wd);
+                        continue;
+                    }
+                    auto dir = dirs.find(ev->wd);
+                    if (dir == dirs.end() || !ev->len) { continue; }
+                    auto rel = join_rel(dir->second, ev->name);
+
+                    if (ev->mask & IN_ISDIR) {
+                        if (ev->mask & (IN_CREATE | IN_MOVED_TO)) add_tree(rel, true);
+                        if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                            drop_tree(rel);
+                            change(rel, WATCH_DELETE_DIR);
+                        }
+                        continue;
+                    }
+                    if (!tree_filter_pass(watch->filter, rel)) { continue; }
+                    if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) change(rel, WATCH_UPLOAD);
+                    if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) change(rel, WATCH_DELETE_FILE);
+                }
+            }
+        }
+
+        if (changes.empty()) { continue; }
+        auto now = Clock::now();
+        if (now - last >= std::chrono::milliseconds(watch->debounce_ms) || now - first >= std::chrono::milliseconds(WATCH_MAX_DELAY_MS) ||
+            changes.size() >= WATCH_MAX_BATCH) {
+            flush_watch(*watch, changes);
+        }
+    }
+    close(fd);
+}
+#endif
+
+void watch_dir(const ReqHead& head, Msgs& msgs, Responser response)
+{
+    auto id = head.id;
+#ifndef __linux__
+    response(CMD_WATCH, id, RES_ERROR_DONE, "watch needs inotify, Linux only");
+    return;
+#else
+    if (!find_session(head.sessionId)) {
+        response(CMD_WATCH, id, RES_ERROR_DONE, fmt::format("Session ID ({}) not found", head.sessionId));
+        return;
+    }
+    if (msgs.size() < 3 || !submitter) {
+        response(CMD_WATCH, id, RES_ERROR_DONE, "watch needs a local and a remote root");
         return;
     }
 
-    actionArgs.session = &sftp_sessions[sessionId];
+    auto watch = std::make_shared<Watch>();
+    watch->id = id;
+    watch->sessionId = head.sessionId;
+    watch->localRoot = fs::absolute(fs::path(msgs[1])).string();
+    watch->remoteRoot = msgs[2];
+    watch->response = response;
+    watch->debounce_ms = WATCH_DEBOUNCE_MS;
+    parse_tree_filter(msgs, 3, watch->filter);
+    for (auto& option : head.options) {
+        if (option.first == "debounce") {
+            watch->debounce_ms = std::max(std::atoi(option.second.c_str()), 1);
+        } else {
+            watch->options += fmt::format(" {}={}", option.first, option.second);
+        }
+    }
 
-    response(CMD_UPLOADS, head.id, RES_INFO, fmt::format(">>>>>>>>>>>>>> {} start upload files count({})", actionArgs.session->hostname, msgs.size() - 3));
+    std::error_code ec;
+    if (!fs::is_directory(watch->localRoot, ec)) {
+        response(CMD_WATCH, id, RES_ERROR_DONE, fmt::format("Local dir not found: {}", watch->localRoot));
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(watches_mutex);
+        watches[id] = watch;
+        watch->thread = std::thread(watch_loop, watch);
+    }
+    response(CMD_WATCH, id, RES_DONE, fmt::format("{}\nwatching {} -> {}", id, watch->localRoot, watch->remoteRoot));
+#endif
+}
 
-    for (size_t i = 3; i < msgs.size(); ++i) {
-        actionArgs.path = msgs[i];
-        auto err = upload_one_file(actionArgs);
-        if (err){
-            if (err.isSftpErr()){
-                actionArgs.err =  err.code();
-                int r = check_reconnect_action(actionArgs);
-                if (r == 0) {
-                    upload_one_file(actionArgs);
-                } else if (r < 0) {
-                    return;
-                }
+// stop watches of a session (every session when < 0), only the one with watch_id unless it is < 0
+// their threads are joined, nothing of them runs on return
+int stop_watches(int sessionId, int watch_id)
+{
+    std::vector<std::shared_ptr<Watch>> stopped;
+    {
+        std::lock_guard<std::mutex> lock(watches_mutex);
+        for (auto it = watches.begin(); it != watches.end();) {
+            if ((sessionId < 0 || it->second->sessionId == sessionId) && (watch_id < 0 || it->first == watch_id)) {
+                it->second->stop = true;
+                stopped.push_back(it->second);
+                it = watches.erase(it);
+            } else {
+                ++it;
             }
         }
     }
+    for (auto& watch : stopped) {
+        if (watch->thread.joinable()) watch->thread.join();
+    }
+    return (int)stopped.size();
+}
+
+void unwatch_dir(const ReqHead& head, Msgs& msgs, Responser response)
+{
+    int watch_id = msgs.size() > 1 && !msgs[1].empty() ? std::atoi(std::string(msgs[1]).c_str()) : -1;
+    int stopped = stop_watches(head.sessionId, watch_id);
+    response(CMD_UNWATCH, head.id, stopped ? RES_DONE : RES_ERROR_DONE, fmt::format("stopped watches({})", stopped));
+}
+
+/** metadata commands
+ * libssh only has async requests for read/write, every other request is a blocking round trip,
+ * so a batch is pipelined by spreading its paths over the session's lanes like a transfer
+ */
+
+const char* remote_type_str(uint8_t type)
+{
+    switch (type) {
+    case SSH_FILEXFER_TYPE_REGULAR:
+        return "file";
+    case SSH_FILEXFER_TYPE_DIRECTORY:
+        return "dir";
+    case SSH_FILEXFER_TYPE_SYMLINK:
+        return "link";
+    default:
+        return "other";
+    }
+}
 
-    response(CMD_UPLOADS, actionArgs.id, RES_DONE,
-             fmt::format("<<<<<<<<<<< {} upload done count({}) session({})", actionArgs.session->hostname, msgs.size() - 3, sessionId));
+// a missing or forbidden path is the answer for that path, anything else may need a reconnect
+Err meta_error(ActionArgs& action, const std::string& what)
+{
+    int errcode = sftp_get_error(action.session->sftp);
+    action.response(action.cmd, action.id, RES_ERROR, fmt::format("{} failed: {}, err ({}) {}", what, action.path, errcode, sftp_error_str(errcode)));
+    if (errcode == SSH_FX_NO_SUCH_FILE || errcode == SSH_FX_PERMISSION_DENIED || errcode == SSH_FX_NO_SUCH_PATH || errcode == SSH_FX_FAILURE ||
+        errcode == SSH_FX_FILE_ALREADY_EXISTS) {
+        return Err::error(-2);
+    }
+    return Err::sftpError(errcode);
 }
 
-Err download_one_file(ActionArgs& action)
+std::string attr_str(sftp_attributes attrs)
 {
-    auto& session = *action.session;
-    int id = action.id;
-    auto localRoot = action.localRoot;
-    auto remoteRoot = action.remoteRoot;
-    auto path = action.path;
-    auto response = action.response;
-    std::string abs_local = fs::absolute(fs::path(localRoot) / path).string();
-    std::string abs_remote = fs::absolute(fs::path(remoteRoot) / path).generic_string();
+    return fmt::format("type({}) size({}) mtime({}) mode({:o})", remote_type_str(attrs->type), attrs->size, attrs->mtime, attrs->permissions & 07777);
+}
 
-    sftp_file remote_file = sftp_open(session.sftp, abs_remote.data(), O_RDONLY, 0);
-    if (!remote_file) {
+Err stat_one(ActionArgs& action)
+{
+    auto abs_remote = remote_path_of(action, action.path);
+    auto attrs = sftp_stat(action.session->sftp, abs_remote.c_str());
+    if (!attrs) { return meta_error(action, "stat"); }
+    action.response(action.cmd, action.id, RES_INFO, fmt::format("{} {}", action.path, attr_str(attrs)));
+    sftp_attributes_free(attrs);
+    return Err::success();
+}
+
+// a remote directory and everything below it, depth first, symlinks are removed and not followed
+bool remove_tree(SFTPSession& session, const std::string& abs_dir)
+{
+    auto dir = sftp_opendir(session.sftp, abs_dir.c_str());
+    if (!dir) { return false; }
+    std::vector<std::string> files, subdirs;
+    sftp_attributes attrs;
+    while ((attrs = sftp_readdir(session.sftp, dir))) {
+        std::string name = attrs->name ? attrs->name : "";
+        if (name != "" && name != "." && name != "..") (attrs->type == SSH_FILEXFER_TYPE_DIRECTORY ? subdirs : files).push_back(abs_dir + "/" + name);
+        sftp_attributes_free(attrs);
+    }
+    sftp_closedir(dir);
+
+    bool ok = true;
+    for (auto& path : files) ok = sftp_unlink(session.sftp, path.c_str()) == SSH_OK && ok;
+    for (auto& path : subdirs) ok = remove_tree(session, path) && ok;
+    if (session.dirs) session.dirs->forget(abs_dir);
+    return ok && sftp_rmdir(session.sftp, abs_dir.c_str()) == SSH_OK;
+}
+
+// files are unlinked, empty directories removed, with "recursive" directories go with their content
+Err remove_one(ActionArgs& action)
+{
+    auto& session = *action.session;
+    auto abs_remote = remote_path_of(action, action.path);
+    if (sftp_unlink(session.sftp, abs_remote.c_str()) != SSH_OK) {
         int errcode = sftp_get_error(session.sftp);
-        response(                         //
-            CMD_DOWNLOADS, id, RES_ERROR, //
-            fmt::format("Remote file open failed: {}, err ({}): {}", abs_remote, errcode, sftp_error_str(errcode)));
-        if (errcode == SSH_FX_NO_SUCH_FILE || errcode == SSH_FX_PERMISSION_DENIED || errcode == SSH_FX_NO_SUCH_PATH){
+        // openssh answers a directory with SSH_FX_FAILURE
+        if (errcode != SSH_FX_FAILURE && errcode != SSH_FX_PERMISSION_DENIED) { return meta_error(action, "remove"); }
+        if (sftp_rmdir(session.sftp, abs_remote.c_str()) != SSH_OK &&
+            !(option_int(action, "recursive", 0) && remove_tree(session, abs_remote))) {
+            return meta_error(action, "remove");
+        }
+        if (session.dirs) session.dirs->forget(abs_remote);
+    }
+    action.response(action.cmd, action.id, RES_INFO, fmt::format("{} removed", action.path));
+    return Err::success();
+}
+
+// queued as "from\0to"
+Err rename_one(ActionArgs& action)
+{
+    auto& session = *action.session;
+    auto sep = action.path.find('\0');
+    auto from = remote_path_of(action, action.path.substr(0, sep));
+    auto to = remote_path_of(action, action.path.substr(sep + 1));
+    int errcode = remote_replace(session.sftp, from, to);
+    if (errcode != 0) {
+        action.response(action.cmd, action.id, RES_ERROR,
+                        fmt::format("rename failed: {} -> {}, err ({}) {}", from, to, errcode, sftp_error_str(errcode)));
+        if (errcode == SSH_FX_NO_SUCH_FILE || errcode == SSH_FX_PERMISSION_DENIED || errcode == SSH_FX_NO_SUCH_PATH || errcode == SSH_FX_FAILURE) {
             return Err::error(-2);
-        }else{
-            return Err::sftpError(errcode);
         }
+        return Err::sftpError(errcode);
     }
+    // a renamed directory takes its cached subdirectories along
+    if (session.dirs) session.dirs->clear();
+    action.response(action.cmd, action.id, RES_INFO, fmt::format("{} -> {} renamed", from, to));
+    return Err::success();
+}
 
-    std::ofstream localFile(abs_local, std::ios::binary);
-    if (!localFile.is_open()) {
-        response(                         //
-            CMD_DOWNLOADS, id, RES_ERROR, //
-            fmt::format("Local file open failed: {}", abs_local));
-        sftp_close(remote_file);
-        return Err::error(-1);
+Err mkdir_one(ActionArgs& action)
+{
+    auto& session = *action.session;
+    auto abs_remote = remote_path_of(action, action.path);
+    auto err = ensure_remote_tree(session.sftp, abs_remote, session.dirs.get());
+    if (err != "") {
+        int errcode = sftp_get_error(session.sftp);
+        action.response(action.cmd, action.id, RES_ERROR, err);
+        return errcode == SSH_FX_NO_CONNECTION || errcode == SSH_FX_CONNECTION_LOST ? Err::sftpError(errcode) : Err::error(-2);
     }
+    action.response(action.cmd, action.id, RES_INFO, fmt::format("{} created", action.path));
+    return Err::success();
+}
 
-    char buffer[4096];
-    int bytesRead;
-    while ((bytesRead = sftp_read(remote_file, buffer, sizeof(buffer))) > 0) { localFile.write(buffer, bytesRead); }
+// one response per directory, its path and then a line per entry
+Err readdir_one(ActionArgs& action)
+{
+    auto& session = *action.session;
+    auto abs_remote = remote_path_of(action, action.path);
+    auto dir = sftp_opendir(session.sftp, abs_remote.c_str());
+    if (!dir) { return meta_error(action, "readdir"); }
 
-    sftp_close(remote_file);
-    response(                        //
-        CMD_DOWNLOADS, id, RES_INFO, //
-        fmt::format("File downloaded successfully {} -> {}", abs_remote, path));
+    std::string listing(action.path);
+    while (auto attrs = sftp_readdir(session.sftp, dir)) {
+        std::string_view name = attrs->name ? attrs->name : "";
+        if (!name.empty() && name != "." && name != "..") listing += fmt::format("\n{} {}", attr_str(attrs), name);
+        sftp_attributes_free(attrs);
+    }
+    bool complete = sftp_dir_eof(dir);
+    sftp_closedir(dir);
+    if (!complete) { return meta_error(action, "readdir"); }
+
+    action.response(action.cmd, action.id, RES_INFO, listing);
     return Err::success();
 }
 
-void downloads(const ReqHead& head, std::vector<std::string>& msgs, Responser response)
-{
+// lanes for stat/readdir batches without a "pool" option
+#define META_POOL 8
 
+void meta_batch(const ReqHead& head, Msgs& msgs, Responser response, int cmd, TransferOne op, const char* name)
+{
     ActionArgs actionArgs;
     actionArgs.id = head.id;
-    actionArgs.localRoot = msgs[1];
-    actionArgs.remoteRoot = msgs[2];
+    actionArgs.cmd = cmd;
+    actionArgs.remoteRoot = msgs.size() > 1 ? msgs[1] : "";
     actionArgs.response = response;
+    actionArgs.err = 0;
+    actionArgs.options = &head.options;
+    actionArgs.metrics = nullptr;
+    actionArgs.skip = nullptr;
+    actionArgs.skipped = false;
     auto sessionId = head.sessionId;
 
-    if (!sftp_sessions.count(sessionId)) {
-        response(                                         //
-            CMD_DOWNLOADS, actionArgs.id, RES_ERROR_DONE, //
+    actionArgs.session = find_session(sessionId);
+    if (!actionArgs.session) {
+        response(                             //
+            cmd, actionArgs.id, RES_ERROR_DONE, //
             fmt::format("Session ID ({}) not found", sessionId));
         return;
     }
 
-    actionArgs.session = &sftp_sessions[sessionId];
+    FileQueue queue;
+    size_t count = 0;
+    if (cmd == CMD_RENAME) {
+        for (size_t i = 2; i + 1 < msgs.size(); i += 2, ++count) {
+            std::string pair(msgs[i]);
+            pair += '\0';
+            pair += msgs[i + 1];
+            queue.push(std::move(pair));
+        }
+    } else {
+        for (size_t i = 2; i < msgs.size(); ++i, ++count) queue.push(std::string(msgs[i]));
+    }
+    queue.close();
+
+    Metrics metrics;
+    metrics.queue_us = head.queued_us;
+    if (option_int(actionArgs, "metrics", 0)) actionArgs.metrics = &metrics;
 
-    response(CMD_DOWNLOADS, head.id, RES_INFO, fmt::format(">>>>>>>>>>>>>> {} start download files count({})", actionArgs.session->hostname, msgs.size() - 3));
+    // lookups fan out over the lanes, changes run in request order on the session's own connection
+    // ("rm d/f d", renames a->b b->c, mkdir parents first)
+    bool ordered = cmd != CMD_STAT && cmd != CMD_READDIR;
+    // one blocking round trip per path, so lookups only gain from several connections, "pool" overrides META_POOL
+    Options options = head.options;
+    if (!ordered && !options.count("pool") && session_option(*actionArgs.session, "pool").empty()) options["pool"] = std::to_string(META_POOL);
+    actionArgs.options = &options;
+    BatchResult result;
+    run_batch(actionArgs, queue, ordered ? 1 : count, op, result);
+    report_metrics(actionArgs);
+
+    response(cmd, actionArgs.id, result.untried > 0 ? RES_ERROR_DONE : RES_DONE,
+             fmt::format("<<<<<<<<<<< {} {} done count({}) failed({}) lanes({}) session({})", actionArgs.session->hostname, name, result.done.load(),
+                         result.failed.load(), result.lanes.load(), sessionId));
+}
 
-    for (size_t i = 5; i < msgs.size(); ++i) {
-        actionArgs.path = msgs[i];
-        auto err = download_one_file(actionArgs);
-        if (err){
+void remote_stat(const ReqHead& head, Msgs& msgs, Responser response) { meta_batch(head, msgs, response, CMD_STAT, stat_one, "stat"); }
 
-        }
+void remote_remove(const ReqHead& head, Msgs& msgs, Responser response) { meta_batch(head, msgs, response, CMD_REMOVE, remove_one, "remove"); }
 
-        int r = check_reconnect_action(actionArgs);
-        if (r == 0) {
-            download_one_file(actionArgs);
-        } else if (r < 0) {
-            return;
+void remote_rename(const ReqHead& head, Msgs& msgs, Responser response) { meta_batch(head, msgs, response, CMD_RENAME, rename_one, "rename"); }
+
+void remote_mkdir(const ReqHead& head, Msgs& msgs, Responser response) { meta_batch(head, msgs, response, CMD_MKDIR, mkdir_one, "mkdir"); }
+
+void remote_readdir(const ReqHead& head, Msgs& msgs, Responser response) { meta_batch(head, msgs, response, CMD_READDIR, readdir_one, "readdir"); }
+
+void status_session(const ReqHead& head, Msgs& msgs, Responser response)
+{
+    (void)msgs;
+    auto id = head.id;
+    auto sessionId = head.sessionId;
+
+    auto stats = find_stats(sessionId);
+    if (!stats) {
+        response(CMD_STATUS_SESSION, id, RES_ERROR_DONE, fmt::format("Session ID ({}) not found", sessionId));
+        return;
+    }
+
+    auto now = Clock::now();
+    uint64_t bytes = stats->bytes;
+    bool busy = stats->busy;
+    auto busy_us = stats->busy_us.load() + (busy ? elapsed_us(stats->opened) - stats->batch_start_us : 0);
+
+    std::string lanes;
+    double now_mb_s;
+    {
+        std::lock_guard<std::mutex> lock(stats->mutex);
+        auto sec = std::chrono::duration<double>(now - stats->sample_at).count();
+        now_mb_s = sec > 0 ? (bytes - stats->sample_bytes) / (1024.0 * 1024.0) / sec : 0.0;
+        stats->sample_bytes = bytes;
+        stats->sample_at = now;
+
+        for (size_t i = 0; i < stats->lanes.size(); ++i) {
+            auto& lane = *stats->lanes[i];
+            std::string file;
+            {
+                std::lock_guard<std::mutex> lane_lock(lane.mutex);
+                file = lane.file;
+            }
+            if (file.empty()) { continue; }
+            lanes += fmt::format("\nlane({}) file({}) offset({}) size({})", i, file, lane.offset.load(), lane.size.load());
         }
     }
 
-    response(CMD_DOWNLOADS, actionArgs.id, RES_DONE,
-             fmt::format("<<<<<<<<<<< {} downboad done count({}) session({})", actionArgs.session->hostname, msgs.size() - 3, sessionId));
+    response(CMD_STATUS_SESSION, id, RES_DONE,
+             fmt::format("session({}) busy({}) bytes({}) files_done({}) files_failed({}) files_remaining({}) avg_mb_s({:.2f}) now_mb_s({:.2f}) "
+                         "reconnects({}) reconnect_ms({:.3f}) reconnect_total_ms({:.3f}) pings({}){}",
+                         sessionId, busy ? 1 : 0, bytes, stats->done.load(), stats->failed.load(), std::max(stats->pending.load(), 0),
+                         busy_us > 0 ? bytes / (1024.0 * 1024.0) / (busy_us / 1e6) : 0.0, now_mb_s, stats->reconnects.load(),
+                         stats->reconnect_us / 1e3, stats->reconnect_total_us / 1e3, stats->pings.load(), lanes));
 }
 
-void close_session(const ReqHead& head, std::vector<std::string>& msgs, Responser response)
+void close_session(const ReqHead& head, Msgs& msgs, Responser response)
 {
+    (void)msgs;
     auto id = head.id;
     auto sessionId = head.sessionId;
 
-    if (!sftp_sessions.count(sessionId)) {
+    auto* found = find_session(sessionId);
+    if (!found) {
         response(                              //
             CMD_DOWNLOADS, id, RES_ERROR_DONE, //
             fmt::format("Session ID ({}) not found", sessionId));
         return;
     }
 
-    auto& session = sftp_sessions[sessionId];
+    auto& session = *found;
 
-    clear_login(session);
-    sftp_sessions.erase(sessionId);
+    // the connections stay open for the next session to the same host, see ConnPool
+    stop_watches(sessionId, -1);
+    for (auto& lane : session.lanes) release_login(lane);
+    if (session.stripes) {
+        std::lock_guard<std::mutex> lock(session.stripes->busy);
+        for (auto& conn : session.stripes->conns) release_login(conn);
+    }
+    release_login(session);
+    {
+        std::lock_guard<std::mutex> lock(sftp_sessions_mutex);
+        sftp_sessions.erase(sessionId);
+    }
     response(CMD_DOWNLOADS, id, RES_DONE, std::to_string(sessionId));
 }
 
+/** session_init again, up to 3 tries 500 ms apart
+ * counted in the session stats with its latency, see status_session
+ */
+bool reconnect_session(SFTPSession& session, Responser response, int cmd, int id)
+{
+    if (session.dirs) session.dirs->clear(); // whatever changed while we were away
+    auto start = Clock::now();
+    for (int retry = 0; !session_init(session, response, cmd, id);) {
+        if (++retry == 3) { return false; }
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    }
+    if (session.stats) {
+        auto us = elapsed_us(start);
+        session.stats->reconnects++;
+        session.stats->reconnect_us = us;
+        session.stats->reconnect_total_us += us;
+    }
+    return true;
+}
+
+/** keepalive: a health thread looks at the sessions every HEALTH_TICK_MS, one idle for "keepalive" seconds
+ * (session option, off by default) gets a ping request through the scheduler, so it never races the session's own requests,
+ * the ping sends an SSH ignore message and stats "." over sftp, a dead connection is reconnected right there,
+ * the probe runs on the session's worker with the ssh timeout lowered to PING_TIMEOUT_SEC, a hung one fails there like a dead one,
+ * the health thread only reads the session list and queues requests
+ * lanes only get the local connection check, a dead one is dropped and reconnects on its next use
+ */
+#define HEALTH_TICK_MS 1000
+#define PING_TIMEOUT_SEC 5
+
+long long keepalive_us(const SFTPSession& session) { return std::max(std::atoll(session_option(session, "keepalive").c_str()), 0LL) * 1000000LL; }
+
+std::mutex health_mutex;
+std::condition_variable health_condition;
+std::thread health_thread;
+bool health_stop = false; // guarded by health_mutex, see stop_background
+
+void health_loop()
+{
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(health_mutex);
+            if (health_condition.wait_for(lock, std::chrono::milliseconds(HEALTH_TICK_MS), [] { return health_stop; })) { return; }
+        }
+        if (!submitter) { continue; }
+        std::vector<int> due;
+        {
+            std::lock_guard<std::mutex> lock(sftp_sessions_mutex);
+            for (auto& entry : sftp_sessions) {
+                auto& session = entry.second;
+                auto* stats = session.stats.get();
+                auto keepalive = keepalive_us(session);
+                if (!stats || keepalive <= 0) { continue; }
+                auto now_us = elapsed_us(stats->opened);
+                if (stats->busy || now_us - stats->used_us < keepalive || stats->ping_queued.exchange(true)) { continue; }
+                due.push_back(entry.first);
+            }
+        }
+        for (auto sessionId : due) submitter({fmt::format("{} {} {}", CMD_PING, internal_request_id++, sessionId)});
+    }
+}
+
+void start_health()
+{
+    std::lock_guard<std::mutex> lock(health_mutex);
+    if (!health_thread.joinable() && !health_stop) health_thread = std::thread(health_loop);
+}
+
+void stop_background()
+{
+    stop_watches(-1, -1);
+    {
+        std::lock_guard<std::mutex> lock(health_mutex);
+        health_stop = true;
+    }
+    health_condition.notify_all();
+    if (health_thread.joinable()) health_thread.join();
+}
+
+// a round trip through the server, false when the connection is gone
+bool connection_alive(SFTPSession& session)
+{
+    if (!session.ssh || !session.sftp || !ssh_is_connected(session.ssh)) { return false; }
+    if (ssh_send_ignore(session.ssh, "") != SSH_OK) { return false; }
+    if (auto attrs = sftp_stat(session.sftp, ".")) {
+        sftp_attributes_free(attrs);
+        return true;
+    }
+    int err = sftp_get_error(session.sftp);
+    return err != SSH_FX_NO_CONNECTION && err != SSH_FX_CONNECTION_LOST && ssh_is_connected(session.ssh);
+}
+
+void ping_session(const ReqHead& head, Msgs& msgs, Responser response)
+{
+    (void)msgs;
+    auto* found = find_session(head.sessionId);
+    if (!found) { return; } // closed since the ping was queued
+    auto& session = *found;
+    auto* stats = session.stats.get();
+    if (!stats) { return; }
+    stats->ping_queued = false;
+    stats->pings++;
+
+    for (auto& lane : session.lanes) {
+        if (lane.ssh && !ssh_is_connected(lane.ssh)) clear_login(lane);
+    }
+
+    // an idle probe needs no long wait, the transfers get the usual timeout back
+    long timeout = PING_TIMEOUT_SEC;
+    if (session.ssh) ssh_options_set(session.ssh, SSH_OPTIONS_TIMEOUT, &timeout);
+    bool alive = connection_alive(session);
+    timeout = SSH_TIMEOUT_SEC;
+    if (session.ssh) ssh_options_set(session.ssh, SSH_OPTIONS_TIMEOUT, &timeout);
+    touch_session(head.sessionId);
+    if (alive) { return; }
+
+    // quiet: the client did not ask for this, only the outcome is reported
+    if (reconnect_session(session, quiet_response, CMD_PING, head.id)) {
+        response(CMD_PING, head.id, RES_DONE,
+                 fmt::format("keepalive session({}) reconnected reconnect_ms({:.3f})", head.sessionId, stats->reconnect_us / 1e3));
+    } else {
+        response(CMD_PING, head.id, RES_ERROR_DONE, fmt::format("keepalive session({}) reconnect failed, the next request tries again", head.sessionId));
+    }
+}
+
 /** result:
  * (r==0)reconnect success
  * (r>0)ok or other error
@@ -446,15 +4485,12 @@ int check_reconnect_action(ActionArgs& action)
         action.response(cmd, id, RES_ERROR, "Try to reinitialize SFTP session");
         int status = ssh_get_status(session.ssh);
         if ((status & (SSH_CLOSED | SSH_CLOSED_ERROR)) || err == SSH_FX_NO_CONNECTION || err == SSH_FX_CONNECTION_LOST) {
-            auto retry = 0;
-            while (retry < 3 && !session_init(session, action.response, CMD_UPLOADS, id)) {
-                retry++;
-                if (retry == 3) {
-                    action.response(cmd, id, RES_ERROR_DONE, "Failed to reinitialize SFTP session");
-                    return -1;
-                }
-                std::this_thread::sleep_for(std::chrono::milliseconds(500));
+            auto connect_start = Clock::now();
+            if (!reconnect_session(session, action.response, cmd, id)) {
+                action.response(cmd, id, RES_ERROR, "Failed to reinitialize SFTP session");
+                return -1;
             }
+            add_metric(&Metrics::connect_us, action, connect_start);
         }
         return 0;
     }
@@ -485,33 +4521,89 @@ std::string sftp_error_str(int code)
     }
 }
 
-std::string ensure_remote_dir(sftp_session sftp, const std::string& remote_path)
+// another lane may have created it meanwhile, openssh answers SSH_FX_FAILURE for that
+bool remote_is_dir(sftp_session sftp, const std::string& path)
+{
+    auto attrs = sftp_stat(sftp, path.c_str());
+    if (!attrs) { return false; }
+    bool is_dir = attrs->type == SSH_FILEXFER_TYPE_DIRECTORY;
+    sftp_attributes_free(attrs);
+    return is_dir;
+}
+
+std::string ensure_remote_dir(sftp_session sftp, const std::string& remote_path, DirCache* dirs)
+{
+    return ensure_remote_tree(sftp, remote_path.substr(0, remote_path.find_last_of('/')), dirs);
+}
+
+// walk up to the first cached or existing directory (one stat each), then mkdir down
+std::string ensure_remote_tree(sftp_session sftp, std::string subdir, DirCache* dirs)
 {
-    size_t pos;
     std::stack<std::string> mkdir_commands;
-    std::string subdir = remote_path.substr(0, remote_path.find_last_of('/'));
+    auto exists = [sftp, dirs](const std::string& dir) { return (dirs && dirs->has(dir)) || remote_is_dir(sftp, dir); };
 
-    auto opendir = sftp_opendir(sftp, subdir.c_str());
-    while (!opendir) {
+    while (!exists(subdir)) {
         mkdir_commands.push(subdir);
         int i = subdir.find_last_of('/');
-        if (i <= 0) { break; }
+        if (i <= 0) {
+            subdir.clear();
+            break;
+        }
         subdir.erase(i);
-        opendir = sftp_opendir(sftp, subdir.c_str());
     }
 
-    if (opendir) sftp_closedir(opendir);
+    if (dirs && !subdir.empty()) dirs->add(subdir);
 
     while (!mkdir_commands.empty()) {
         auto& path = mkdir_commands.top();
         if (sftp_mkdir(sftp, path.c_str(), S_IRWXU) != SSH_OK) {
             int err_code = sftp_get_error(sftp);
-            if (err_code != SSH_FX_FILE_ALREADY_EXISTS) //
+            if (err_code != SSH_FX_FILE_ALREADY_EXISTS && !remote_is_dir(sftp, path)) //
             {
                 return fmt::format("Failed to create remote directory: {}, code: {}", path, err_code);
             }
         }
+        if (dirs) dirs->add(path);
         mkdir_commands.pop();
     }
     return "";
 }
+
+/** create the parent directories of a batch before any file is opened
+ * only the deepest directories are walked (an existing one proves its parents),
+ * shallow first so shared new parents are made once and cached for the rest
+ */
+void plan_remote_dirs(ActionArgs& action, const Msgs& msgs, size_t first)
+{
+    auto& session = *action.session;
+    std::unordered_set<std::string> parents;
+    for (size_t i = first; i < msgs.size(); ++i) {
+        auto abs_remote = (fs::path(action.remoteRoot) / msgs[i]).generic_string();
+        auto slash = abs_remote.find_last_of('/');
+        if (slash != std::string::npos && slash > 0) parents.insert(abs_remote.substr(0, slash));
+    }
+
+    std::unordered_set<std::string> inner; // parents of other listed directories
+    for (auto& dir : parents) {
+        for (auto slash = dir.find_last_of('/'); slash != std::string::npos && slash > 0; slash = dir.find_last_of('/', slash - 1)) {
+            if (!inner.insert(dir.substr(0, slash)).second) { break; }
+        }
+    }
+
+    std::vector<std::string> leaves;
+    for (auto& dir : parents) {
+        if (inner.count(dir) || (session.dirs && session.dirs->has(dir))) { continue; }
+        leaves.push_back(dir);
+    }
+
+    auto depth = [](const std::string& dir) { return std::count(dir.begin(), dir.end(), '/'); };
+    std::sort(leaves.begin(), leaves.end(), [&depth](const std::string& a, const std::string& b) { return depth(a) < depth(b); });
+
+    for (auto& dir : leaves) {
+        auto err = ensure_remote_tree(session.sftp, dir, session.dirs.get());
+        if (err != "") {
+            // the file opens will report it again per file
+            action.response(action.cmd, action.id, RES_INFO, fmt::format("ensure remote dir failed: {}", err));
+        }
+    }
+}
@@ -4,6 +4,7 @@
 #define YKM22_LUA_SFTP_PIP_IMPL_H
 
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 enum
@@ -23,15 +24,31 @@ enum
     CMD_DOWNLOADS = 2,
     CMD_CLOSE_SESSION = 3,
     CMD_STATUS_SESSION = 4,
-    CMD_READY = 99,
+    CMD_UPLOAD_DIR = 5,
+    CMD_DOWNLOAD_DIR = 6,
+    CMD_STAT = 7,
+    CMD_REMOVE = 8,
+    CMD_RENAME = 9,
+    CMD_MKDIR = 10,
+    CMD_READDIR = 11,
+    CMD_WATCH = 12,
+    CMD_UNWATCH = 13,
+    CMD_FANOUT = 14,
+    CMD_PING = 15, // keepalive, made by the health thread, see ping_session
+    CMD_READY = 99, // "99 <id> 0 framing=binary" switches to length-prefixed frames, see sftp_pip.cc
     CMD_EXIT = 100,
 };
 
+// "key=value" pairs, a bare "key" is stored as "1"
+using Options = std::unordered_map<std::string, std::string>;
+
 struct ReqHead{
     int cmd;
     int id;
     int sessionId;
     void* session;
+    Options options; // optional tokens after sessionId on the head line
+    long long queued_us; // time the request waited for a worker
 };
 
 struct ResHead{
@@ -40,37 +57,183 @@ struct ResHead{
     int status;
 };
 
+// request lines, views into the receive buffer of the task
+using Msgs = std::vector<std::string_view>;
+
 void wait_working(void* session);
 
 void get_req_head(std::string_view msgs, ReqHead& head);
 
+// the session had a request, keepalive waits a full idle period from here
+// call from the worker that runs the session's task, not from the reader thread
+void touch_session(int sessionId);
+
+void parse_option(std::string_view token, Options& options);
+
 using Responser = void(*)(int cmd, int id, int status, const std::string& response);
 
+// hands a request, head line first, to the scheduler as if it came from stdin
+using Submitter = void (*)(const std::vector<std::string>& lines);
+
+// requests made inside (watch batches, keepalive pings) go through it,
+// they get ids from 1 << 30 up, clients keep their ids below that so responses are not confused
+void set_submitter(Submitter submit);
+
+// stop and join the threads that read the sessions on their own (watches, keepalive), for the exit path
+void stop_background();
+
+// bytes per second over all sessions ("10M", "512K", plain bytes), empty or 0 for unlimited
+void set_global_rate(const std::string& rate);
+
+/** open an authenticated connection at startup and park it in the connection pool
+ * spec: [user@]host[:port], matching a later new_session with the same username, hostname and port and no password
+ * public key authentication only, password hosts only get pooled connections from their own sessions
+*/
+void warm_connection(const std::string& spec, Responser response);
+
 /**
+  reuses a pooled connection with the same hostname/username/password/port,
+  the pool holds the connections of closed sessions, the extra lanes of every session between its batches
+  and the --warm ones, a client with one long-lived session per host reuses only lanes
 1: hostname
 2: username
 3: password
 4: port
+... session options, one "key=value" per line
+  window: write/read requests kept in flight per file (default 16, 1 = no pipelining)
+  chunk: bytes per request, clamped to the server limits (default 256 KiB)
+  pool: connections a batch is spread over (default 1, up to 32, opened on first use, pooled between batches)
+  metrics: report a RES_INFO timing line per request (queue, connect, open, transfer, close)
+    and once per session the time from the request and from process start to the first file data
+  skip: uploads and upload_dir leave unchanged files alone, "mtime" (size + mtime) or "hash" (sha256 via remote sha256sum)
+  resume: transfer into "<target>.sftp_pip.part", continue a retry after its size, rename when complete
+    "verify" compares the last 64 KiB before continuing
+  compression: zlib level 0-9 ("yes" = 6), "auto" samples the local files of each upload batch
+    and reconnects with level 3 when they compress to 60% or better, off again only when worse than 75%
+  ciphers: preferred cipher list, "fast" = AEAD ciphers with AES-GCM first on cpus with AES instructions, chacha20 otherwise
+  macs: preferred MAC list or "fast" (etm MACs, the default with "ciphers=fast")
+  identity: private key file tried before the default ones for public key authentication
+  rate: bytes per second for the session and its lanes ("10M", "512K"), on top of the global --rate
+  tar: uploads send files below 4 KiB ("tar=16K": below 16 KiB) as one tar stream into a remote "tar -x",
+    the rest through sftp, needs tar on the remote, not combined with skip or resume
+  tar_gzip: gzip the tar stream
+  verify: hash each file while it streams (sha256, large files on a separate thread) and compare with
+    a remote sha256sum after the transfer, a mismatch fails the file, a failed download is removed
+  stripe: files of stripe_min bytes or more go over this many connections at once (2-16), one byte range each,
+    into a part file that is renamed after a size check, one striped file per session at a time, resume does not apply
+  stripe_min: size threshold for stripe (default 256M)
+  delta: uploads over an existing remote file of delta_min bytes or more (default 8M) send only the changed blocks,
+    block hashes by a remote python3 or by reading the remote blocks, the remote copy is made with cp and renamed into place,
+    reports the bytes saved, needs cp on the remote (full upload otherwise), resume does not apply
+  delta_block: block size for delta (default 128K)
+  engine: "event" drives uploads/downloads of all sessions from one event thread instead of lanes,
+    many files in flight over the session's connection, not with resume, verify, delta or stripe
+  engine_files: files open at once per request with engine=event (default 64)
+  keepalive: seconds a session may sit idle before a background ping checks it and reconnects a dead one (default 0 = off)
 */
-void new_session(const ReqHead& head, std::vector<std::string>& msgs, Responser response);
+void new_session(const ReqHead& head, Msgs& msgs, Responser response);
 
 /**
 1: local root
 2: remote root
 ... files
 */
-void uploads(const ReqHead& head, std::vector<std::string>& msgs, Responser response);
+void uploads(const ReqHead& head, Msgs& msgs, Responser response);
 
 /**
 1: local root
 2: remote root
 ... files
 */
-void downloads(const ReqHead& head, std::vector<std::string>& msgs, Responser response);
+void downloads(const ReqHead& head, Msgs& msgs, Responser response);
+
+/**
+1: local root
+2: remote root
+... filters, "+glob" include, "-glob" exclude
+  a glob without '/' matches the file name, otherwise the relative path, "**" crosses directories
+*/
+void upload_dir(const ReqHead& head, Msgs& msgs, Responser response);
+
+/**
+1: local root
+2: remote root
+... filters, same as upload_dir
+*/
+void download_dir(const ReqHead& head, Msgs& msgs, Responser response);
+
+/**
+  metadata batches, one RES_INFO/RES_ERROR per path
+  each path is one blocking round trip, the gain comes from several connections:
+  stat and readdir are spread over "pool" connections, 8 when neither request nor session sets pool,
+  remove, rename and mkdir run in the given order on the session's own connection, one request but no faster than separate ones
+1: remote root, paths are relative to it (empty root: paths as given)
+... paths
+*/
+// "path type(file|dir|link|other) size(n) mtime(n) mode(octal)"
+void remote_stat(const ReqHead& head, Msgs& msgs, Responser response);
+
+// unlink files, rmdir empty directories, with "recursive=1" a directory goes with its content
+void remote_remove(const ReqHead& head, Msgs& msgs, Responser response);
+
+// paths in pairs: from, to, replacing an existing target
+void remote_rename(const ReqHead& head, Msgs& msgs, Responser response);
+
+// mkdir -p
+void remote_mkdir(const ReqHead& head, Msgs& msgs, Responser response);
+
+// per directory: its path, then "type(..) size(..) mtime(..) mode(..) name" per entry
+void remote_readdir(const ReqHead& head, Msgs& msgs, Responser response);
+
+/**
+  watch a local tree with inotify (Linux) and upload/remove its changes on the session
+  head option "debounce=ms" (default 200): quiet time before a batch is flushed, other head options go on to the batches
+1: local root
+2: remote root
+... filters, same as upload_dir
+  RES_DONE with the watch id (the request id) right away, then a RES_INFO per flushed batch naming its request ids
+*/
+void watch_dir(const ReqHead& head, Msgs& msgs, Responser response);
+
+/**
+1: watch id, empty for every watch of the session (close_session stops them too)
+*/
+void unwatch_dir(const ReqHead& head, Msgs& msgs, Responser response);
+
+/**
+  the same files to several sessions, each local chunk is read once and written to every session
+  head option "fanout_buffer=N" (default 64M): bytes a slow session may fall behind before the reader waits for it
+  runs once every listed session is done with its earlier requests, the session id of the head line is not used
+1: session ids, space separated
+2: local root
+3: remote root
+... files
+  each target is written as "<target>.sftp_pip.part" and renamed into place when complete, a failed one is removed,
+  a session that reconnects uploads its interrupted file once more on its own
+  RES_ERROR per failed file, RES_DONE with done/failed/bytes per session (RES_ERROR_DONE when a session was lost)
+*/
+void fanout_uploads(const ReqHead& head, Msgs& msgs, Responser response);
+
+/**
+  only head, answered while a transfer of the session runs
+  body: session(id) busy(0|1) bytes(n) files_done(n) files_failed(n) files_remaining(n) avg_mb_s(x) now_mb_s(x) reconnects(n)
+    reconnect_ms(x) reconnect_total_ms(x) pings(n)
+    reconnect_ms is the latency of the last reconnect, after a failed transfer or a failed keepalive ping
+    avg_mb_s is over the time spent in transfers, now_mb_s since the previous status request
+    then a "lane(i) file(path) offset(n) size(n)" line per connection with a file in progress
+*/
+void status_session(const ReqHead& head, Msgs& msgs, Responser response);
+
+/**
+  only head, queued by the health thread for an idle session (see the keepalive option)
+  sends an SSH ignore message and stats "." over sftp, reconnects when that fails
+  silent while the connection is fine, otherwise RES_DONE/RES_ERROR_DONE with the reconnect outcome
+*/
+void ping_session(const ReqHead& head, Msgs& msgs, Responser response);
 
 /**
   only head
 */
-void close_session(const ReqHead& head, std::vector<std::string>& msgs, Responser response);
+void close_session(const ReqHead& head, Msgs& msgs, Responser response);
 
 #endif // !YKM22_LUA_SFTP_PIP_IMPL_H
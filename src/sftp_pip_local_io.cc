@@ -0,0 +1,212 @@
+#include "sftp_pip_local_io.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define IO_ALIGN 4096
+
+// smaller files are read with pread, a file saved over while it uploads then gives a short read, not SIGBUS
+#define MAP_MIN (1024 * 1024)
+
+#ifndef _WIN32
+
+LocalSource::~LocalSource() { close(); }
+
+bool LocalSource::open(const std::string& path)
+{
+    close();
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) { return false; }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close();
+        return false;
+    }
+    opened = true;
+    length = st.st_size;
+
+    // small and special files are read, everything else mapped
+    if (S_ISREG(st.st_mode) && length >= MAP_MIN) {
+        void* addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED) {
+            mapping = (const char*)addr;
+            madvise(addr, length, MADV_SEQUENTIAL);
+        }
+    }
+    return true;
+}
+
+void LocalSource::close()
+{
+    if (mapping) munmap((void*)mapping, length);
+    if (fd >= 0) ::close(fd);
+    mapping = nullptr;
+    fd = -1;
+    length = 0;
+    opened = false;
+}
+
+const char* LocalSource::view(uint64_t offset, size_t len, char* buffer)
+{
+    if (mapping) {
+        // touching pages past a truncated end raises SIGBUS, a file that shrank fails like a short read,
+        // the check narrows the window to the caller's use of the chunk
+        struct stat st;
+        if (offset + len > length || fstat(fd, &st) != 0 || (uint64_t)st.st_size < offset + len) { return nullptr; }
+        return mapping + offset;
+    }
+    size_t got = 0;
+    while (got < len) {
+        auto n = pread(fd, buffer + got, len - got, offset + got);
+        if (n <= 0) { return nullptr; }
+        got += n;
+    }
+    return buffer;
+}
+
+LocalSink::~LocalSink() { close(); }
+
+bool LocalSink::open(const std::string& path, bool truncate)
+{
+    close();
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | (truncate ? O_TRUNC : 0), 0644);
+    opened = fd >= 0;
+    failed = false;
+    reserved = 0;
+    return opened;
+}
+
+void LocalSink::preallocate(uint64_t size)
+{
+#if defined(__linux__)
+    // blocks only, the length still ends at the last byte written, so a part file left by a crash resumes from there
+    if (fd >= 0 && size > 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size) == 0) reserved = size;
+#endif
+}
+
+bool LocalSink::write_at(uint64_t offset, const char* data, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        auto n = pwrite(fd, data + done, len - done, offset + done);
+        if (n <= 0) {
+            failed = true;
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+bool LocalSink::finish(uint64_t size)
+{
+    if (fd < 0) { return false; }
+    if (reserved > size && ftruncate(fd, size) != 0) failed = true;
+    if (::close(fd) != 0) failed = true;
+    fd = -1;
+    opened = false;
+    return !failed;
+}
+
+void LocalSink::close()
+{
+    if (fd >= 0) ::close(fd);
+    fd = -1;
+    opened = false;
+}
+
+AlignedBuffer::AlignedBuffer(size_t size) : len(size)
+{
+    void* mem = nullptr;
+    if (posix_memalign(&mem, IO_ALIGN, size ? size : 1) != 0) mem = nullptr;
+    ptr = (char*)mem;
+}
+
+AlignedBuffer::~AlignedBuffer() { free(ptr); }
+
+#else // _WIN32: plain stdio, no mapping
+
+LocalSource::~LocalSource() { close(); }
+
+bool LocalSource::open(const std::string& path)
+{
+    close();
+    auto* fp = std::fopen(path.c_str(), "rb");
+    if (!fp) { return false; }
+    _fseeki64(fp, 0, SEEK_END);
+    length = _ftelli64(fp);
+    file = fp;
+    opened = true;
+    return true;
+}
+
+void LocalSource::close()
+{
+    if (file) std::fclose((FILE*)file);
+    file = nullptr;
+    length = 0;
+    opened = false;
+}
+
+const char* LocalSource::view(uint64_t offset, size_t len, char* buffer)
+{
+    auto* fp = (FILE*)file;
+    if (_fseeki64(fp, offset, SEEK_SET) != 0) { return nullptr; }
+    return std::fread(buffer, 1, len, fp) == len ? buffer : nullptr;
+}
+
+LocalSink::~LocalSink() { close(); }
+
+bool LocalSink::open(const std::string& path, bool truncate)
+{
+    close();
+    auto* fp = std::fopen(path.c_str(), truncate ? "wb" : "r+b");
+    if (!fp && !truncate) fp = std::fopen(path.c_str(), "wb");
+    file = fp;
+    opened = fp != nullptr;
+    failed = false;
+    return opened;
+}
+
+void LocalSink::preallocate(uint64_t size) {}
+
+bool LocalSink::write_at(uint64_t offset, const char* data, size_t len)
+{
+    auto* fp = (FILE*)file;
+    if (_fseeki64(fp, offset, SEEK_SET) != 0 || std::fwrite(data, 1, len, fp) != len) {
+        failed = true;
+        return false;
+    }
+    return true;
+}
+
+bool LocalSink::finish(uint64_t size)
+{
+    if (!file) { return false; }
+    if (std::fclose((FILE*)file) != 0) failed = true;
+    file = nullptr;
+    opened = false;
+    return !failed;
+}
+
+void LocalSink::close()
+{
+    if (file) std::fclose((FILE*)file);
+    file = nullptr;
+    opened = false;
+}
+
+AlignedBuffer::AlignedBuffer(size_t size) : len(size) { ptr = (char*)_aligned_malloc(size ? size : 1, IO_ALIGN); }
+
+AlignedBuffer::~AlignedBuffer() { _aligned_free(ptr); }
+
+#endif
@@ -0,0 +1,99 @@
+#pragma once
+#ifndef YKM22_LUA_SFTP_PIP_LOCAL_IO_H
+#define YKM22_LUA_SFTP_PIP_LOCAL_IO_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+  local side of a transfer
+
+  LocalSource maps files of 1 MiB and more read-only, chunks are handed to sftp writes
+  straight from the mapping. Smaller files, special files and windows use reads.
+*/
+class LocalSource
+{
+  public:
+    LocalSource() = default;
+    ~LocalSource();
+    LocalSource(const LocalSource&) = delete;
+    LocalSource& operator=(const LocalSource&) = delete;
+
+    bool open(const std::string& path);
+    void close();
+
+    bool is_open() const { return opened; }
+    uint64_t size() const { return length; }
+    // view() points into the mapping, chunks stay valid while the source is open
+    bool mapped() const { return mapping != nullptr; }
+
+    /** pointer to len bytes at offset
+     * mapped: points into the mapping, buffer is untouched
+     * otherwise: read into buffer (at least len bytes), null on error
+     */
+    const char* view(uint64_t offset, size_t len, char* buffer);
+
+  private:
+    bool opened = false;
+    uint64_t length = 0;
+    const char* mapping = nullptr;
+#ifdef _WIN32
+    void* file = nullptr;
+#else
+    int fd = -1;
+#endif
+};
+
+/**
+  LocalSink writes at explicit offsets (pwrite), so chunks may land in any order,
+  disk space is reserved when the final size is known, the file length only grows with the writes
+*/
+class LocalSink
+{
+  public:
+    LocalSink() = default;
+    ~LocalSink();
+    LocalSink(const LocalSink&) = delete;
+    LocalSink& operator=(const LocalSink&) = delete;
+
+    // truncate: start empty, otherwise keep the content (resume)
+    bool open(const std::string& path, bool truncate);
+    // reserve blocks for size bytes up front without changing the length, a hint only
+    void preallocate(uint64_t size);
+    bool write_at(uint64_t offset, const char* data, size_t len);
+    // release reserved blocks beyond size and close, false if anything failed
+    bool finish(uint64_t size);
+    void close();
+
+    bool is_open() const { return opened; }
+
+  private:
+    bool opened = false;
+    bool failed = false;
+    uint64_t reserved = 0;
+#ifdef _WIN32
+    void* file = nullptr;
+#else
+    int fd = -1;
+#endif
+};
+
+// page aligned buffer for the chunk reads of downloads
+class AlignedBuffer
+{
+  public:
+    explicit AlignedBuffer(size_t size);
+    ~AlignedBuffer();
+    AlignedBuffer(const AlignedBuffer&) = delete;
+    AlignedBuffer& operator=(const AlignedBuffer&) = delete;
+
+    char* data() { return ptr; }
+    size_t size() const { return len; }
+
+  private:
+    char* ptr;
+    size_t len;
+};
+
+#endif // !YKM22_LUA_SFTP_PIP_LOCAL_IO_H
@@ -1,6 +1,7 @@
 add_requires("libssh")
 add_requires("fmt")
 add_requires("openssl")
+add_requires("zlib")
 
 if is_plat("macosx") then
     set_arch("x86_64")
@@ -10,13 +11,15 @@ local function sftp_pip()
     set_languages("cxx17")
     add_files(
         "src/sftp_pip.cc",
-        "src/sftp_pip_impl.cc"
+        "src/sftp_pip_impl.cc",
+        "src/sftp_pip_local_io.cc"
     )
     if is_plat("macosx") then
         set_arch("x86_64")
     end
     add_packages("libssh")
     add_packages("openssl")
+    add_packages("zlib")
     add_packages("fmt")
     after_build(function (target)
         -- Get the target file path (e.g., build output)
@@ -34,3 +37,24 @@ set_optimize("smallest")
 add_ldflags("-s", {force = true})
 set_symbols("none")
 sftp_pip()
+
+-- xmake run local_io_bench [MiB] [dir]
+target("local_io_bench")
+set_default(false)
+set_kind("binary")
+set_languages("cxx17")
+set_optimize("fastest")
+add_files(
+    "bench/local_io_bench.cc",
+    "src/sftp_pip_local_io.cc"
+)
+
+-- xmake run sftp_bench --bin ./sftp_pip [--delay-ms 20] [--shape many-tiny|few-huge|deep-tree|all] [--scale 1]
+-- starts its own sshd on localhost, prints one JSON line per shape and direction
+target("sftp_bench")
+set_default(false)
+set_kind("binary")
+set_languages("cxx17")
+set_optimize("fastest")
+add_files("bench/sftp_bench.cc")
+add_syslinks("pthread")